@@ -0,0 +1,169 @@
+/*-----------------------------------------------------------------------------
+  atlas.c
+  10/18/2026
+
+  Reads and appends packed tile image atlas files. See atlas.h
+
+  -----------------------------------------------------------------------------
+*/
+
+// Libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <Judy.h>   // requires libjudy installed, and compile flag -lJudy
+#include "mosaic.h"
+#include "atlas.h"
+
+//-----------------------------------------------------------------------------
+// Creates atlas filename from library path (e.g. "lib/atlas_sm.idx")
+
+void atlasFilename(char *buf, size_t len, const char *libPath, const char *sizeExt, const char *fileExt)
+{
+  size_t n = strlen(libPath);
+  const char *slash = (n > 0 && libPath[n-1] == '/') ? "" : "/";
+  snprintf(buf, len, "%s%satlas_%s.%s", libPath, slash, sizeExt, fileExt);
+}
+
+//-----------------------------------------------------------------------------
+// Returns file extension of size class used by tile files (sm, md, lg),
+// from size given on command line, same as create.pl (sm, med, lg).
+// Returns NULL if not a valid size.
+
+const char *atlasSizeExt(const char *sizeType)
+{
+  if (strcmp(sizeType, "sm") == 0) return "sm";
+  if (strcmp(sizeType, "med") == 0 || strcmp(sizeType, "md") == 0) return "md";
+  if (strcmp(sizeType, "lg") == 0) return "lg";
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Maps an entire file into memory (read-only). Returns NULL if file is empty.
+
+static void *mapFile(const char *filename, int64_t *size)
+{
+  int fd;
+  void *map;
+  struct stat statBuf;
+
+  if ((fd = open(filename, O_RDONLY)) < 0) die("Cannot open atlas file!");
+  if (fstat(fd, &statBuf) != 0) die("Cannot stat atlas file!");
+  *size = statBuf.st_size;
+  if (*size == 0) { close(fd); return NULL; }
+
+  map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) die("Cannot map atlas file!");
+  close(fd);  // mapping stays valid
+  return map;
+}
+
+//-----------------------------------------------------------------------------
+// Opens atlas of given size class for reading.
+// Returns: 1 if opened, 0 if library has no atlas of this size.
+
+int atlasOpen(Atlas *atlas, const char *libPath, const char *sizeExt)
+{
+  char idxFile[1024], datFile[1024];
+  int64_t idxSize;
+  int i;
+  Word_t *pvalue;
+
+  atlasFilename(idxFile, sizeof(idxFile), libPath, sizeExt, "idx");
+  atlasFilename(datFile, sizeof(datFile), libPath, sizeExt, "dat");
+  memset(atlas, 0, sizeof(Atlas));
+  if (access(idxFile, R_OK) != 0 || access(datFile, R_OK) != 0) return 0;
+
+  atlas->entries = (AtlasEntry *) mapFile(idxFile, &idxSize);
+  atlas->numEntries = idxSize / sizeof(AtlasEntry);
+  atlas->pixels = (uint8_t *) mapFile(datFile, &atlas->pixelsSize);
+
+  // index entries by imageID, later entries replace earlier ones
+  for (i=0; i < atlas->numEntries; i++) {
+    if (atlas->entries[i].magic != ATLAS_MAGIC) die("Atlas index magic number invalid.");
+    if (atlas->entries[i].offset + 3LL * atlas->entries[i].width * atlas->entries[i].height > atlas->pixelsSize) {
+      die("Atlas index points past end of atlas data file!");
+    }
+    JLI(pvalue, atlas->idList, (Word_t) atlas->entries[i].imageID);  // JudyLIns()
+    if (pvalue == PJERR) { die("Judy malloc() error!"); }
+    *pvalue = i + 1;
+  }
+  return 1;
+}
+
+void atlasClose(Atlas *atlas)
+{
+  Word_t bytes;
+
+  if (atlas->entries) munmap(atlas->entries, (size_t)atlas->numEntries * sizeof(AtlasEntry));
+  if (atlas->pixels) munmap(atlas->pixels, atlas->pixelsSize);
+  JLFA(bytes, atlas->idList);  // JudyLFreeArray()
+  memset(atlas, 0, sizeof(Atlas));
+}
+
+//-----------------------------------------------------------------------------
+// Returns pointer to RGB pixels of tile inside the mapped atlas, or NULL if
+// tile is not in atlas.
+
+uint8_t *atlasTile(Atlas *atlas, int32_t imageID, int *width, int *height)
+{
+  Word_t *pvalue;
+  AtlasEntry *entry;
+
+  JLG(pvalue, atlas->idList, (Word_t) imageID);  // JudyLGet()
+  if (pvalue == NULL) return NULL;
+  entry = &atlas->entries[*pvalue - 1];
+  *width = entry->width;
+  *height = entry->height;
+  return atlas->pixels + entry->offset;
+}
+
+//-----------------------------------------------------------------------------
+// Opens atlas of given size class for appending, creating files if needed.
+
+void atlasWriterOpen(AtlasWriter *writer, const char *libPath, const char *sizeExt)
+{
+  char idxFile[1024], datFile[1024];
+
+  atlasFilename(idxFile, sizeof(idxFile), libPath, sizeExt, "idx");
+  atlasFilename(datFile, sizeof(datFile), libPath, sizeExt, "dat");
+  if ((writer->dat = fopen(datFile, "ab")) == NULL) die("Cannot open atlas data file for appending!");
+  if ((writer->idx = fopen(idxFile, "ab")) == NULL) die("Cannot open atlas index file for appending!");
+  if (fseeko(writer->dat, 0, SEEK_END) != 0) die("Cannot seek atlas data file!");
+  writer->offset = ftello(writer->dat);
+}
+
+// Appends one tile. Pixels are written before the index entry, so an
+// interrupted append never leaves an entry pointing at missing pixels.
+
+void atlasWriteTile(AtlasWriter *writer, int32_t imageID, int width, int height, const uint8_t *rgb)
+{
+  AtlasEntry entry;
+  size_t size = (size_t)width * height * 3;
+
+  entry.magic = ATLAS_MAGIC;
+  entry.imageID = imageID;
+  entry.width = width;
+  entry.height = height;
+  entry.offset = writer->offset;
+
+  if (fwrite(rgb, 1, size, writer->dat) != size) die("Problem writing atlas data!");
+  if (fflush(writer->dat) != 0) die("Problem writing atlas data!");
+  if (fwrite(&entry, sizeof(AtlasEntry), 1, writer->idx) != 1) die("Problem writing atlas index!");
+  writer->offset += size;
+}
+
+void atlasWriterClose(AtlasWriter *writer)
+{
+  if (fclose(writer->idx) != 0) die("Cannot close atlas index file!");
+  if (fclose(writer->dat) != 0) die("Cannot close atlas data file!");
+}
+
+// EOF
@@ -0,0 +1,51 @@
+/*-----------------------------------------------------------------------------
+  atlas.h
+  10/18/2026
+
+  Packed tile image atlas. Each size class (sm, md, lg) of a library is
+  stored as two append-only files in the library directory:
+
+    atlas_sm.dat   RGB pixels of every tile, 3 bytes per pixel, row by row.
+    atlas_sm.idx   one AtlasEntry per tile: imageID -> offset in .dat file.
+
+  -----------------------------------------------------------------------------
+*/
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <Judy.h>   // requires libjudy installed, and compile flag -lJudy
+#include "mosaic.h"
+
+// Atlas opened for reading, with both files mapped into memory.
+typedef struct {
+  AtlasEntry *entries;
+  int numEntries;
+  uint8_t *pixels;
+  int64_t pixelsSize;
+  Pvoid_t idList;       // JudyL array: imageID -> index in entries + 1
+} Atlas;
+
+// Atlas opened for appending new tiles.
+typedef struct {
+  FILE *dat;
+  FILE *idx;
+  int64_t offset;       // end of .dat file
+} AtlasWriter;
+
+void die(char* errMsg);   // defined by each program
+
+void atlasFilename(char *buf, size_t len, const char *libPath, const char *sizeExt, const char *fileExt);
+const char *atlasSizeExt(const char *sizeType);
+
+int atlasOpen(Atlas *atlas, const char *libPath, const char *sizeExt);
+void atlasClose(Atlas *atlas);
+uint8_t *atlasTile(Atlas *atlas, int32_t imageID, int *width, int *height);
+
+void atlasWriterOpen(AtlasWriter *writer, const char *libPath, const char *sizeExt);
+void atlasWriteTile(AtlasWriter *writer, int32_t imageID, int width, int height, const uint8_t *rgb);
+void atlasWriterClose(AtlasWriter *writer);
+
+#endif
@@ -0,0 +1,146 @@
+/*-----------------------------------------------------------------------------
+  atlasrender.c
+  10/18/2026
+
+  Creates photomosaic image from mosaic program's CSV output, copying tile
+  pixels straight out of the mapped tile atlas (see mkatlas.c).
+  Output is a binary PPM image, one row of pixels at a time, so the whole
+  mosaic is never held in memory.
+
+  Usage:
+    atlasrender lib_path [sm|med|lg] < input.csv > output.ppm
+    atlasrender lib_path med < input.csv | convert ppm:- output.png
+
+  -----------------------------------------------------------------------------
+*/
+
+// Libraries
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <Judy.h>   // requires libjudy installed, and compile flag -lJudy
+#include "mosaic.h"
+#include "atlas.h"
+
+void die(char* errMsg) {
+
+  fprintf(stderr, "\nERROR: %s\n", errMsg);
+  exit(1);
+}
+
+int usage(const char *progname) {
+
+  fprintf(stderr, "Usage: %s lib_path [sm|med|lg] < input.csv > output.ppm \n", progname);
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+// Copies one row of a tile into row buffer, mirroring it if tile is flipped.
+// Pads with black if tile is smaller than a cell.
+
+void copyTileRow(uint8_t *dest, int cellW, uint8_t *tile, int w, int h, int r, int flip)
+{
+  int x, n = (w < cellW) ? w : cellW;
+  uint8_t *src;
+
+  if (tile == NULL || r >= h) { memset(dest, 0, cellW * 3); return; }
+  src = tile + (size_t)r * w * 3;
+  if (flip) {
+    for (x=0; x < n; x++) { memcpy(dest + x * 3, src + (w - 1 - x) * 3, 3); }
+  }
+  else {
+    memcpy(dest, src, n * 3);
+  }
+  if (n < cellW) memset(dest + n * 3, 0, (cellW - n) * 3);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+
+  // init variables
+  int i, r, tx, ty, pos, Ydelta, imgID, numTiles, missing, cellW = 0, cellH = 0, w, h;
+  int32_t *tileIDs;
+  int *tileW, *tileH;
+  uint8_t **tiles, *rowBuf;
+  char line[1024];
+  const char *sizeExt;
+  MosaicHeader hdr;
+  Atlas atlas;
+
+  // process command line
+  if (argc != 3) { return usage(argv[0]); }
+  if ((sizeExt = atlasSizeExt(argv[2])) == NULL) { return usage(argv[0]); }
+  fprintf(stderr, "Running atlasrender\n");
+  if (!atlasOpen(&atlas, argv[1], sizeExt)) die("Library has no atlas of this size. Run mkatlas first.");
+  fprintf(stderr, "  atlas: %s  tiles:%d\n", sizeExt, atlas.numEntries);
+
+  //--- Read input.csv ---
+  if (fgets(line, sizeof(line), stdin) == NULL ||
+      sscanf(line, " %d , %d , %d , %d , %d , %d , %d , %d , %d", &hdr.Xtiles, &hdr.Ytiles,
+             &hdr.Xblocks, &hdr.Yblocks, &hdr.flags, &hdr.Wy, &hdr.Wc, &hdr.We, &hdr.dups) != 9) {
+    die("CSV first line missing values or incorrectly formatted!");
+  }
+  numTiles = hdr.Xtiles * hdr.Ytiles;
+  if (numTiles < 1) die("CSV first line has invalid values!");
+  fprintf(stderr, "Creating %dx%d tiled photomosaic\n", hdr.Xtiles, hdr.Ytiles);
+
+  // missing positions are left as blank tile 0
+  tileIDs = (int32_t *) calloc(numTiles, sizeof(int32_t));
+  if (tileIDs == NULL) die("Could not init tileIDs");
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    if (sscanf(line, " %d , %d , %d", &pos, &Ydelta, &imgID) != 3) continue;
+    if (pos < 0 || pos >= numTiles) die("CSV tile position out of range!");
+    tileIDs[pos] = imgID;
+  }
+
+  // size of every cell is taken from first tile found in atlas
+  for (i=0; i < numTiles && cellW == 0; i++) {
+    if (atlasTile(&atlas, abs(tileIDs[i]), &w, &h) != NULL) { cellW = w; cellH = h; }
+  }
+  if (cellW == 0) die("None of the mosaic's tiles are in the atlas!");
+
+  // tiles added to library since mkatlas last ran would be left black
+  for (i=0, missing=0; i < numTiles; i++) {
+    if (tileIDs[i] != 0 && atlasTile(&atlas, abs(tileIDs[i]), &w, &h) == NULL) missing++;
+  }
+  if (missing > 0) {
+    fprintf(stderr, "  missing from atlas: %d tiles\n", missing);
+    die("Mosaic has tiles that aren't in the atlas. Run mkatlas again.");
+  }
+
+  rowBuf = (uint8_t *) malloc((size_t)cellW * hdr.Xtiles * 3);
+  tiles = (uint8_t **) malloc(hdr.Xtiles * sizeof(uint8_t *));
+  tileW = (int *) malloc(hdr.Xtiles * sizeof(int));
+  tileH = (int *) malloc(hdr.Xtiles * sizeof(int));
+  if (rowBuf == NULL || tiles == NULL || tileW == NULL || tileH == NULL) die("Could not allocate row buffer");
+
+  //--- Output photomosaic ---
+  printf("P6\n%d %d\n255\n", cellW * hdr.Xtiles, cellH * hdr.Ytiles);
+  for (ty=0; ty < hdr.Ytiles; ty++) {
+    // look up every tile in this row of the mosaic once
+    for (tx=0; tx < hdr.Xtiles; tx++) {
+      tiles[tx] = atlasTile(&atlas, abs(tileIDs[ty * hdr.Xtiles + tx]), &tileW[tx], &tileH[tx]);
+    }
+    for (r=0; r < cellH; r++) {
+      for (tx=0; tx < hdr.Xtiles; tx++) {
+        copyTileRow(rowBuf + (size_t)tx * cellW * 3, cellW, tiles[tx], tileW[tx], tileH[tx], r,
+                    (tileIDs[ty * hdr.Xtiles + tx] < 0));
+      }
+      if (fwrite(rowBuf, (size_t)cellW * hdr.Xtiles * 3, 1, stdout) != 1) die("Problem writing image!");
+    }
+  }
+  if (fflush(stdout) != 0) die("Problem writing image!");
+
+  // free memory
+  atlasClose(&atlas);
+  free(tileIDs);
+  free(rowBuf);
+  free(tiles); free(tileW); free(tileH);
+
+  fprintf(stderr, "Done atlasrender\n\n");
+  return 0;
+}
+
+// EOF
@@ -18,6 +18,7 @@
 
 use strict;
 use warnings;
+use FindBin;
 
 #------------------------------------------------------------------------------
 # Print Usage info
@@ -58,6 +59,7 @@ sub usage()
   #--- Read input.csv ---
   my $line = <STDIN>;
   chomp $line;
+  my @csvLines = ($line);  # kept for atlasrender
   my ($xTiles, $yTiles, $xBlocks, $yBlocks, $lumFlag, $Wy, $Wc, $We, $dups, undef) = split(',', $line);
   print STDERR "Creating ${xTiles}x${yTiles} tiled photomosaic with up to $dups duplicate tiles.\n";  ## TEST ##
 
@@ -75,6 +77,7 @@ sub usage()
 
   while ($line = <STDIN>) {
     chomp $line;
+    push @csvLines, $line;
     ($pos, $Ydelta, $imgID, undef) = split(',', $line);
 
     # TODO: if $imgID is negative, flip image vertically
@@ -99,7 +102,32 @@ sub usage()
   }
 
   #--- Output photomosaic ---
-  if (($outType eq 'png') || ($outType eq 'jpg')) {
+  my $atlasFile = $libPath .'atlas'. $tileSizeExt{$sizeType};
+  $atlasFile =~ s/\.jpg$/.idx/;  # e.g. "atlas_md.idx"
+
+  if ((($outType eq 'png') || ($outType eq 'jpg')) && (-e $atlasFile)) {
+    #-- Create image from tile atlas (see mkatlas) --
+    # Much faster than montage, which has to open and decode every tile image.
+    # quote paths for the shell (a ' becomes '\'')
+    my ($bin, $lib) = map { my $q = $_; $q =~ s/'/'\\''/g; "'$q'" } ("$FindBin::Bin/atlasrender", $libPath);
+    my $cmd = "$bin $lib $sizeType | convert ppm:- ${outType}:-";
+    print STDERR "Running: $cmd \n";
+
+    my $timeBegin = time;
+    open(PNG, "| $cmd") || die "ERROR: Can't fork to atlasrender: $! (errcode $?)";
+    local $SIG{PIPE} = sub { die "ERROR: atlasrender pipe broke." };
+
+    foreach $line (@csvLines) {
+      print PNG "$line\n";
+    }
+
+    close PNG || die "ERROR: Closing atlasrender pipe: $! (errcode $?)";
+    my $timeEnd = time;
+    print STDERR sprintf( "Atlas render took %.0f secs.\n", $timeEnd - $timeBegin );
+    print STDERR "Done atlas render.\n";
+
+  }
+  elsif (($outType eq 'png') || ($outType eq 'jpg')) {
     #-- Create PNG image --
     # NOTE: How to create PNG using ImageMagick:
     #  echo "img1.png im2.png ... imgN.png" | montage @-  -mode Concatenate  -tile 20x30  png:-
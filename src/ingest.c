@@ -0,0 +1,525 @@
+/*-----------------------------------------------------------------------------
+  ingest.c
+  10/18/2026
+
+  Adds video frames to a mosaic library straight from a raw RGB frame stream,
+  such as ffmpeg's rawvideo output, without writing each frame to an image
+  file first. Does the same as addtiles.pl does for each image: crops the
+  frame to a square, makes the 8x8 block tile record, and adds it to
+  mosaic.db, mosaic.txt and filelist.txt. Tile images are written to the
+  library's atlas (see atlas.h), and optionally as _sm, _md and _lg JPEG
+  files using ImageMagick.
+
+  Usage:
+    ffmpeg -i input.mp4 -r 1 -f rawvideo -pix_fmt rgb24 - | ingest -w 1920 -h 1080 lib_path
+
+  -----------------------------------------------------------------------------
+*/
+
+// Libraries
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+
+#include <Judy.h>   // requires libjudy installed, and compile flag -lJudy
+#include "mosaic.h"
+#include "atlas.h"
+
+//-----------------------------------------------------------------------------
+// Command Line Options
+
+#define FALSE  0
+#define TRUE   1
+#define THREADS_MAX  64
+#define LG_SIZE  512        // same as addtiles.pl (square)
+#define MD_SIZE  128        // 25%
+#define SM_SIZE  32         // 6.25%
+
+// option vars
+const char *opt_libpath = NULL;
+const char *opt_name = "stdin";
+int opt_width = 0;
+int opt_height = 0;
+int opt_threads = 4;
+int opt_dupes_flag = FALSE;
+int opt_score = 0;
+int opt_jpeg_flag = FALSE;
+int opt_atlas[3] = { FALSE, FALSE, FALSE };  // sm, md, lg
+const char *sizeExts[3] = { "sm", "md", "lg" };
+const int sizePixels[3] = { SM_SIZE, MD_SIZE, LG_SIZE };
+
+volatile sig_atomic_t exitFlag = FALSE;
+pthread_mutex_t popenLock = PTHREAD_MUTEX_INITIALIZER;
+
+int usage(const char *progname) {
+
+  fprintf(stderr, "ingest - adds video frames to a mosaic library\n");
+  fprintf(stderr, "Usage: %s [options] -w <width> -h <height> lib_path < frames.rgb\n", progname);
+  fprintf(stderr, "Options:\n"
+    "\t-w <width>  : Width of frames in pixels.\n"
+    "\t-h <height> : Height of frames in pixels.\n"
+    "\t-d <score>  : Drop frames within score of the last frame added. (e.g. 500)\n"
+    "\t-a <size>   : Add tiles of this size to atlas: sm, med, or lg. May be repeated. (default=sm,med)\n"
+    "\t-j          : Also write _sm, _md and _lg JPEG tile images using ImageMagick.\n"
+    "\t-t <num>    : Number of threads. (default=4)\n"
+    "\t-n <name>   : Name of video to record in filelist.txt. (default=stdin)\n"
+    "\n"
+    "\tFrames must be raw 8-bit RGB (e.g. ffmpeg -f rawvideo -pix_fmt rgb24 -)\n"
+    "\n"
+  );
+  return 1;
+}
+
+int cmdLine(int argc, char *argv[]) {
+
+  // command line options
+  int opt, i, anyFlag = FALSE;
+  const char *ext;
+  while ((opt = getopt(argc, argv, "?w:h:d:a:jt:n:")) != -1) {
+    switch (opt) {
+      case 'w':  // frame width
+        if (sscanf(optarg, "%d", &opt_width) != 1 || opt_width < 1) {
+          fprintf(stderr, "Invalid width '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'h':  // frame height
+        if (sscanf(optarg, "%d", &opt_height) != 1 || opt_height < 1) {
+          fprintf(stderr, "Invalid height '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'd':  // dupe score
+        opt_dupes_flag = TRUE;
+        if (sscanf(optarg, "%d", &opt_score) != 1 || opt_score < 0) {
+          fprintf(stderr, "Invalid dupe score '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'a':  // atlas size
+        if ((ext = atlasSizeExt(optarg)) == NULL) {
+          fprintf(stderr, "Invalid size '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        for (i=0; i < 3; i++) {
+          if (strcmp(ext, sizeExts[i]) == 0) opt_atlas[i] = TRUE;
+        }
+        anyFlag = TRUE;
+        break;
+      case 'j':  // jpeg tile images
+        opt_jpeg_flag = TRUE;
+        break;
+      case 't':  // threads
+        if (sscanf(optarg, "%d", &opt_threads) != 1 || opt_threads < 1 || opt_threads > THREADS_MAX) {
+          fprintf(stderr, "Invalid number of threads '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'n':  // video name
+        opt_name = strdup(optarg);
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+  // lg tiles take 768KB each, so only when asked for
+  if (!anyFlag) { opt_atlas[0] = opt_atlas[1] = TRUE; }
+  if (optind != argc - 1 || opt_width == 0 || opt_height == 0) return usage(argv[0]);
+  opt_libpath = argv[optind];
+  return 0;
+}
+
+void die(char* errMsg) {
+
+  fprintf(stderr, "\nERROR: %s\n", errMsg);
+  exit(1);
+}
+
+void handleInt(int sig) {
+  exitFlag = TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Area-averages rectangle (sx, sy, sw, sh) of RGB image into dw x dh image.
+// Works for both shrinking and enlarging.
+
+void resample(const uint8_t *src, int w, int sx, int sy, int sw, int sh,
+              uint8_t *dest, int dw, int dh, float *tmp)
+{
+  int x, y, i, c;
+  double scale, a, b, lo, hi, weight;
+  float sum[3];
+
+  // horizontal pass: sh rows of dw pixels into tmp
+  scale = (double)sw / dw;
+  for (x=0; x < dw; x++) {
+    a = x * scale;  b = a + scale;
+    for (y=0; y < sh; y++) {
+      const uint8_t *row = src + ((size_t)(sy + y) * w + sx) * 3;
+      sum[0] = sum[1] = sum[2] = 0;
+      for (i = (int)a; i < b && i < sw; i++) {
+        lo = (i < a) ? a : i;  hi = (i + 1 > b) ? b : i + 1;
+        weight = (hi - lo) / scale;
+        for (c=0; c < 3; c++) { sum[c] += weight * row[i * 3 + c]; }
+      }
+      for (c=0; c < 3; c++) { tmp[((size_t)y * dw + x) * 3 + c] = sum[c]; }
+    }
+  }
+
+  // vertical pass: tmp into dest
+  scale = (double)sh / dh;
+  for (y=0; y < dh; y++) {
+    a = y * scale;  b = a + scale;
+    for (x=0; x < dw; x++) {
+      sum[0] = sum[1] = sum[2] = 0;
+      for (i = (int)a; i < b && i < sh; i++) {
+        lo = (i < a) ? a : i;  hi = (i + 1 > b) ? b : i + 1;
+        weight = (hi - lo) / scale;
+        for (c=0; c < 3; c++) { sum[c] += weight * tmp[((size_t)i * dw + x) * 3 + c]; }
+      }
+      for (c=0; c < 3; c++) {
+        sum[c] += 0.5f;
+        dest[((size_t)y * dw + x) * 3 + c] = (sum[c] > 255) ? 255 : (uint8_t) sum[c];
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Creates tile record from 8x8 RGB blocks, the same way as addtiles.pl
+
+void makeTileRecord(const uint8_t *rgb, TileRecord *tile)
+{
+  int j, r, g, b, Y[BLOCKS], Ysum = 0, Ydelta, temp;
+
+  tile->magic = TILE_MAGIC;
+  for (j=0; j < BLOCKS; j++) {
+    r = rgb[j * 3];  g = rgb[j * 3 + 1];  b = rgb[j * 3 + 2];
+    Y[j] = ((  66*r + 129*g +  25*b + 128 ) / 256) + 16;    // Y range is [16,235]
+    tile->pixel[j].U = (( -38*r -  74*g + 112*b + 128 ) / 256) + 128;   // U range is [0, 255]
+    tile->pixel[j].V = (( 112*r -  94*g -  18*b + 128 ) / 256) + 128;   // V range is [0, 255]
+    tile->pixel[j].E = 0;   // temporary E value
+    Ysum += Y[j];
+  }
+
+  // normalize the Y values
+  Ydelta = Ysum / (BLOCKS) - 128;   // Ydelta is a signed int [-255,+255]
+  tile->Ydelta = Ydelta;
+  for (j=0; j < BLOCKS; j++) {
+    temp = Y[j] - Ydelta;
+    tile->pixel[j].Y = (temp < 0) ? 0 : ((temp > 255) ? 255 : temp);  // clips to [0,255]
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Compares tile records of two frames, scored the same as filterdb's dupes.
+// Lower score is more alike. Score 0 may still differ, since the color part
+// rounds down, so use sameFrame() to drop only identical frames.
+
+int frameScore(TileRecord *a, TileRecord *b)
+{
+  int j, score = 0, Ydelta = a->Ydelta - b->Ydelta;
+  for (j=0; j < BLOCKS; j++) {
+    score +=     abs( a->pixel[j].Y - b->pixel[j].Y + Ydelta )
+            + (( abs( a->pixel[j].U - b->pixel[j].U )
+               + abs( a->pixel[j].V - b->pixel[j].V )) >> 1);
+  }
+  return score;
+}
+
+int sameFrame(TileRecord *a, TileRecord *b)
+{
+  return (a->Ydelta == b->Ydelta && memcmp(a->pixel, b->pixel, sizeof(a->pixel)) == 0);
+}
+
+//-----------------------------------------------------------------------------
+// Frames are processed in batches. Each thread does every opt_threads'th
+// frame in a batch, first making the tile records, then (after dupes are
+// dropped) the tile images. Threads don't die on errors, but return them in
+// their Job for the main thread.
+
+typedef struct {
+  uint8_t *frame;           // raw RGB frame
+  TileRecord tile;
+  uint8_t *sizes[3];        // sm, md, lg tile images
+  int keep;
+  int32_t imageID;
+} Frame;
+
+typedef struct {
+  Frame *frames;
+  int numFrames;
+  int thread;
+  int stage;                // 0 = tile records, 1 = tile images
+  float *tmp;
+  const char *error;        // set by thread if it failed
+} Job;
+
+// Writes _lg, _md and _sm JPEG tile images from the lg tile image.
+// Returns: error message, or NULL if written.
+
+const char *writeJpegs(Frame *f)
+{
+  char dir[1024], cmd[4096];
+  const char *slash = (opt_libpath[strlen(opt_libpath)-1] == '/') ? "" : "/";
+  int id = f->imageID;
+  FILE *PPM;
+  sigset_t pending;
+
+  // create 2-digit subdirectories, same as addtiles.pl (e.g. lib/00/00/00/)
+  snprintf(dir, sizeof(dir), "%s%s%02d", opt_libpath, slash, id / 1000000);
+  mkdir(dir, 0777);
+  snprintf(dir, sizeof(dir), "%s%s%02d/%02d", opt_libpath, slash, id / 1000000, (id / 10000) % 100);
+  mkdir(dir, 0777);
+  snprintf(dir, sizeof(dir), "%s%s%02d/%02d/%02d/", opt_libpath, slash, id / 1000000, (id / 10000) % 100, (id / 100) % 100);
+  mkdir(dir, 0777);
+
+  snprintf(cmd, sizeof(cmd), "convert ppm:- -write '%s%08d_lg.jpg' -resize 25%% -write '%s%08d_md.jpg'"
+           " -resize 25%% '%s%08d_sm.jpg'", dir, id, dir, id, dir, id);
+  // ImageMagick ignores SIGINT (ctrl-C), so the batch can finish, same as mkatlas.
+  // SIGINT is blocked in every thread meanwhile (see runThreads), and handled once
+  // restored. Ignoring it drops one already pending, so that is noted first.
+  // Lock so no thread restores the handler while another forks.
+  pthread_mutex_lock(&popenLock);
+  if (sigpending(&pending) == 0 && sigismember(&pending, SIGINT)) exitFlag = TRUE;
+  signal(SIGINT, SIG_IGN);  // inherited by child
+  PPM = popen(cmd, "w");
+  signal(SIGINT, handleInt);
+  pthread_mutex_unlock(&popenLock);
+  if (PPM == NULL) return "Can't fork to ImageMagick!";
+  fprintf(PPM, "P6\n%d %d\n255\n", LG_SIZE, LG_SIZE);
+  fwrite(f->sizes[2], (size_t)LG_SIZE * LG_SIZE * 3, 1, PPM);
+  if (pclose(PPM) != 0) return "ImageMagick error!";
+  return NULL;
+}
+
+void *processFrames(void *arg)
+{
+  Job *job = (Job *) arg;
+  int i, s, side;
+  uint8_t blocks[BLOCKS * 3];
+  Frame *f;
+
+  // crop center square, same as addtiles.pl's -resize '512x512^' -gravity Center -crop
+  side = (opt_width < opt_height) ? opt_width : opt_height;
+
+  for (i = job->thread; i < job->numFrames; i += opt_threads) {
+    f = &job->frames[i];
+    if (job->stage == 0) {
+      resample(f->frame, opt_width, (opt_width - side) / 2, (opt_height - side) / 2, side, side,
+               blocks, 8, 8, job->tmp);
+      makeTileRecord(blocks, &f->tile);
+      f->tile.xres = opt_width;
+      f->tile.yres = opt_height;
+    }
+    else if (f->keep) {
+      // largest size needed from frame, then each smaller size from the one above
+      s = (f->sizes[2]) ? 2 : 1;
+      resample(f->frame, opt_width, (opt_width - side) / 2, (opt_height - side) / 2, side, side,
+               f->sizes[s], sizePixels[s], sizePixels[s], job->tmp);
+      for (s--; s >= 0; s--) {
+        resample(f->sizes[s+1], sizePixels[s+1], 0, 0, sizePixels[s+1], sizePixels[s+1],
+                 f->sizes[s], sizePixels[s], sizePixels[s], job->tmp);
+      }
+      if (opt_jpeg_flag && (job->error = writeJpegs(f)) != NULL) break;
+    }
+  }
+  return NULL;
+}
+
+void runThreads(Job *jobs, int stage)
+{
+  pthread_t threads[THREADS_MAX];
+  int t;
+  sigset_t intMask, oldMask;
+
+  // threads start with SIGINT blocked, so it's handled here once they're done
+  sigemptyset(&intMask);
+  sigaddset(&intMask, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &intMask, &oldMask);
+  for (t=0; t < opt_threads; t++) {
+    jobs[t].stage = stage;
+    jobs[t].error = NULL;
+    if (pthread_create(&threads[t], NULL, processFrames, &jobs[t]) != 0) die("Cannot create thread!");
+  }
+  for (t=0; t < opt_threads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+  for (t=0; t < opt_threads; t++) {
+    if (jobs[t].error) die((char *) jobs[t].error);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Returns next imageID, same as addtiles.pl: last id in mosaic.txt + 1,
+// or else based on size of mosaic.db
+
+int32_t nextImageID(const char *txtFile, const char *dbFile)
+{
+  FILE *TXT;
+  char buf[8192 + 1], *line;
+  long size;
+  size_t n;
+  int lastId;
+  struct stat statBuf;
+
+  if ((TXT = fopen(txtFile, "r")) != NULL) {
+    // read tail of file, which holds the last line (like tail -n1)
+    if (fseek(TXT, 0, SEEK_END) != 0) die("Cannot seek mosaic.txt!");
+    size = ftell(TXT);
+    fseek(TXT, (size > 8192) ? size - 8192 : 0, SEEK_SET);
+    n = fread(buf, 1, 8192, TXT);
+    fclose(TXT);
+    buf[n] = '\0';
+    while (n > 0 && (buf[n-1] == '\n' || buf[n-1] == ' ')) { buf[--n] = '\0'; }
+    line = strrchr(buf, '\n');
+    line = (line == NULL) ? buf : line + 1;
+    if (sscanf(line, "%d", &lastId) == 1) return lastId + 1;
+  }
+  if (stat(dbFile, &statBuf) == 0) {
+    return statBuf.st_size / sizeof(TileRecord) + 1;
+  }
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+
+  // init variables
+  int e, i, j, s, t, numFrames, batchSize, frameNum = 0, added = 0, dropped = 0;
+  size_t frameSize;
+  int32_t imageID;
+  char dbFile[1024], txtFile[1024], listFile[1024];
+  const char *slash;
+  FILE *DB, *TXT, *LIST;
+  time_t timeBegin, timeEnd;
+  TileRecord lastTile, *tile;
+  int haveLast = FALSE;
+  Frame *frames;
+  Job jobs[THREADS_MAX];
+  AtlasWriter writers[3];
+  memset(&lastTile, 0, sizeof(TileRecord));
+
+  // process command line
+  if ( (e = cmdLine(argc, argv)) ) { return e; }
+  fprintf(stderr, "Running ingest...\n");
+  fprintf(stderr, "  frames:%dx%d  threads:%d  drop dupes:%s  score:%d  jpeg:%s\n", opt_width, opt_height,
+          opt_threads, (opt_dupes_flag ? "yes" : "no"), opt_score, (opt_jpeg_flag ? "yes" : "no"));
+  if (opt_width > INT16_MAX || opt_height > INT16_MAX) die("Frame size too big!");
+
+  // library files, same as addtiles.pl
+  slash = (opt_libpath[strlen(opt_libpath)-1] == '/') ? "" : "/";
+  snprintf(dbFile, sizeof(dbFile), "%s%smosaic.db", opt_libpath, slash);
+  snprintf(txtFile, sizeof(txtFile), "%s%smosaic.txt", opt_libpath, slash);
+  snprintf(listFile, sizeof(listFile), "%s%sfilelist.txt", opt_libpath, slash);
+  imageID = nextImageID(txtFile, dbFile);
+  fprintf(stderr, "Next TileID: %d\n", imageID);
+
+  if ((LIST = fopen(listFile, "a")) == NULL) die("Cannot append to filelist.txt!");
+  if ((TXT = fopen(txtFile, "a")) == NULL) die("Cannot append to mosaic.txt!");
+  if ((DB = fopen(dbFile, "ab")) == NULL) die("Cannot append to mosaic.db!");
+  for (s=0; s < 3; s++) {
+    if (opt_atlas[s]) atlasWriterOpen(&writers[s], opt_libpath, sizeExts[s]);
+  }
+
+  // allocate batch of frames
+  frameSize = (size_t)opt_width * opt_height * 3;
+  batchSize = opt_threads * 4;
+  frames = (Frame *) calloc(batchSize, sizeof(Frame));
+  if (frames == NULL) die("Could not allocate frames");
+  for (i=0; i < batchSize; i++) {
+    frames[i].frame = (uint8_t *) malloc(frameSize);
+    for (s=0; s < 3; s++) {
+      if (s == 2 && !opt_atlas[2] && !opt_jpeg_flag) break;  // lg not needed
+      frames[i].sizes[s] = (uint8_t *) malloc((size_t)sizePixels[s] * sizePixels[s] * 3);
+      if (frames[i].sizes[s] == NULL) die("Could not allocate tile images");
+    }
+    if (frames[i].frame == NULL) die("Could not allocate frames");
+  }
+  for (t=0; t < opt_threads; t++) {
+    jobs[t].frames = frames;
+    jobs[t].thread = t;
+    jobs[t].tmp = (float *) malloc((size_t)((opt_height > LG_SIZE) ? opt_height : LG_SIZE) * LG_SIZE * 3 * sizeof(float));
+    if (jobs[t].tmp == NULL) die("Could not allocate resample buffer");
+  }
+
+  // Handle SIGINT (ctrl-C), finishing current batch
+  signal(SIGINT, handleInt);
+  timeBegin = time(NULL);
+
+  while (!exitFlag) {
+    // read batch of frames
+    for (numFrames=0; numFrames < batchSize; numFrames++) {
+      if (fread(frames[numFrames].frame, 1, frameSize, stdin) != frameSize) break;
+    }
+    if (numFrames == 0) break;
+    for (t=0; t < opt_threads; t++) { jobs[t].numFrames = numFrames; }
+
+    // make tile records, then drop dupes in order
+    runThreads(jobs, 0);
+    for (i=0; i < numFrames; i++) {
+      frames[i].keep = !(opt_dupes_flag && haveLast && ((opt_score == 0) ? sameFrame(&frames[i].tile, &lastTile)
+                                                        : frameScore(&frames[i].tile, &lastTile) <= opt_score));
+      if (frames[i].keep) {
+        frames[i].imageID = frames[i].tile.imageID = imageID++;
+        lastTile = frames[i].tile;
+        haveLast = TRUE;
+      }
+    }
+
+    // make tile images of frames kept
+    runThreads(jobs, 1);
+
+    // append to library in frame order
+    for (i=0; i < numFrames; i++, frameNum++) {
+      if (!frames[i].keep) { dropped++; continue; }
+      tile = &frames[i].tile;
+
+      fprintf(LIST, "%08d %s#%d %dx%d\n", tile->imageID, opt_name, frameNum, opt_width, opt_height);
+      fprintf(TXT, "%d %d %d %d", tile->imageID, tile->Ydelta, tile->xres, tile->yres);
+      for (j=0; j < BLOCKS; j++) {
+        fprintf(TXT, " %d %d %d %d", tile->pixel[j].Y, tile->pixel[j].U, tile->pixel[j].V, tile->pixel[j].E);
+      }
+      fprintf(TXT, "\n");
+      if (fwrite(tile, sizeof(TileRecord), 1, DB) != 1) die("Problem writing tile record!");
+      for (s=0; s < 3; s++) {
+        if (opt_atlas[s]) atlasWriteTile(&writers[s], tile->imageID, sizePixels[s], sizePixels[s], frames[i].sizes[s]);
+      }
+      added++;
+    }
+    fprintf(stderr, "frames: %d  added: %d  dropped: %d\r", frameNum, added, dropped);
+    if (numFrames < batchSize) break;  // end of stream
+  }
+
+  timeEnd = time(NULL);
+  fprintf(stderr, "\nTiles added: %d of %d frames\n", added, frameNum);
+  fprintf(stderr, "Took %.0f secs.\n", difftime(timeEnd, timeBegin) );
+  if (exitFlag) { fprintf(stderr, "Exited early. Next TileID: %d\n", imageID); }
+
+  // close library files
+  for (s=0; s < 3; s++) {
+    if (opt_atlas[s]) atlasWriterClose(&writers[s]);
+  }
+  if (fclose(DB) != 0) die("Cannot close mosaic.db!");
+  if (fclose(TXT) != 0) die("Cannot close mosaic.txt!");
+  if (fclose(LIST) != 0) die("Cannot close filelist.txt!");
+
+  // free memory
+  for (i=0; i < batchSize; i++) {
+    free(frames[i].frame);
+    for (s=0; s < 3; s++) { free(frames[i].sizes[s]); }
+  }
+  free(frames);
+  for (t=0; t < opt_threads; t++) { free(jobs[t].tmp); }
+
+  return 0;
+}
@@ -7,7 +7,7 @@
 # Uses ImageMagick
 #
 # Usage: 
-#   masterimg.pl xtiles ytiles dups image > output.csv 
+#   masterimg.pl xtiles ytiles dups image [region] > output.csv 
 #
 # Version History:
 #  (v1.0) 6/6/2010 addtiles.pl
@@ -58,12 +58,14 @@ sub usage()
 {
   print "Creates CSV of master image to use in a photomosaic. (v1.0) \n";
   print "(c) 2010 Carl Gorringe - carl.gorringe.org\n\n";
-  print "Usage: masterimg.pl xtiles ytiles dups image > output.csv \n";
+  print "Usage: masterimg.pl xtiles ytiles dups image [region] > output.csv \n";
   print "       xtiles is number of tiles across. (e.g. 20)\n";
   print "       ytiles is number of tiles down.   (e.g. 30)\n";
   print "       dups is number of max duplicate tiles. (e.g. 1 or 600)\n";
   print "            (negate to include vertically flipped tiles. TEMP)\n";
   print "       image is master image. Can be any supported type. (png, jpg, etc.)\n";
+  print "       region is optional WxH+X+Y in tiles, to output only those tiles. (e.g. 6x4+10+5)\n";
+  print "            Use with mosaic -l to change only part of a finished mosaic.\n";
   print "       output.csv is text file that can be used as input to mosaic program.\n\n";
   exit(1);
 }
@@ -74,13 +76,14 @@ sub usage()
   my ($i, $j);
 
   # Retrieve command line
-  if (scalar @ARGV != 4) { usage(); }
+  if (scalar @ARGV != 4 && scalar @ARGV != 5) { usage(); }
   print STDERR "Running $0\n";  ## TEST ##
 
   my $xTiles = shift @ARGV;
   my $yTiles = shift @ARGV;
   my $dups = shift @ARGV;
   my $imgFile = shift @ARGV;
+  my $region = shift @ARGV;
 
   my $flags = 0;   #  0x01 = lumFlag, 0x02 = vflipFlag
   if ($dups < 0) {
@@ -90,6 +93,16 @@ sub usage()
     $flags = 2;
   }
   my $numTiles = $xTiles * $yTiles;
+
+  # region of tiles to output (default all)
+  my ($rw, $rh, $rx, $ry) = ($xTiles, $yTiles, 0, 0);
+  if (defined $region) {
+    if ($region !~ /^(\d+)x(\d+)\+(\d+)\+(\d+)$/) { die "Region '$region' must be WxH+X+Y in tiles!"; }
+    ($rw, $rh, $rx, $ry) = ($1, $2, $3, $4);
+    if ($rw < 1 || $rh < 1 || $rx + $rw > $xTiles || $ry + $rh > $yTiles) {
+      die "Region '$region' must be inside ${xTiles}x${yTiles} tiles!";
+    }
+  }
   my $blocks = 8;
   my $xSize = ($blocks * $xTiles);
   my $ySize = ($blocks * $yTiles);
@@ -210,6 +223,7 @@ sub usage()
 
   print "$xTiles,$yTiles,$blocks,$blocks,$flags,1,1,0,$dups\n";
   for ($i=0; $i < $numTiles; $i++) {
+    next if ($i % $xTiles < $rx || $i % $xTiles >= $rx + $rw || int($i / $xTiles) < $ry || int($i / $xTiles) >= $ry + $rh);
     print "$i,0";
     for ($j=0; $j < scalar( @{$bY[$i]} ); $j++) {
       print ",$bY[$i][$j],$bU[$i][$j],$bV[$i][$j],0";
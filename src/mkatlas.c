@@ -0,0 +1,298 @@
+/*-----------------------------------------------------------------------------
+  mkatlas.c
+  10/18/2026
+
+  Packs the _sm, _md and _lg tile images of a library into atlas files
+  (see atlas.h), so renderers don't need to open and decode every tile image.
+  Only tiles not already in the atlas are added, so run this again after
+  addtiles.pl to append the new images.
+
+  Uses ImageMagick to decode the tile images.
+
+  -----------------------------------------------------------------------------
+*/
+
+// Libraries
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <Judy.h>   // requires libjudy installed, and compile flag -lJudy
+#include "mosaic.h"
+#include "atlas.h"
+
+//-----------------------------------------------------------------------------
+// Command Line Options
+
+#define FALSE  0
+#define TRUE   1
+#define BATCH_MAX  100    // max images decoded per ImageMagick run
+
+// option vars
+const char *opt_libpath = NULL;
+int opt_sizes[3] = { FALSE, FALSE, FALSE };  // sm, md, lg
+const char *sizeExts[3] = { "sm", "md", "lg" };
+
+volatile sig_atomic_t exitFlag = FALSE;
+
+int usage(const char *progname) {
+
+  fprintf(stderr, "mkatlas - packs tile images of a library into atlas files\n");
+  fprintf(stderr, "Usage: %s [options] lib_path\n", progname);
+  fprintf(stderr, "Options:\n"
+    "\t-s <size> : Size of tiles to pack: sm, med, or lg. May be repeated. (default=all)\n"
+    "\n"
+  );
+  return 1;
+}
+
+int cmdLine(int argc, char *argv[]) {
+
+  // command line options
+  int opt, i, anyFlag = FALSE;
+  const char *ext;
+  while ((opt = getopt(argc, argv, "?s:")) != -1) {
+    switch (opt) {
+      case 's':  // size class
+        if ((ext = atlasSizeExt(optarg)) == NULL) {
+          fprintf(stderr, "Invalid size '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        for (i=0; i < 3; i++) {
+          if (strcmp(ext, sizeExts[i]) == 0) opt_sizes[i] = TRUE;
+        }
+        anyFlag = TRUE;
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+  if (!anyFlag) { opt_sizes[0] = opt_sizes[1] = opt_sizes[2] = TRUE; }
+  if (optind != argc - 1) return usage(argv[0]);
+  opt_libpath = argv[optind];
+  return 0;
+}
+
+void die(char* errMsg) {
+
+  fprintf(stderr, "\nERROR: %s\n", errMsg);
+  exit(1);
+}
+
+void handleInt(int sig) {
+  exitFlag = TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Creates tile image filename from imageID (e.g. "lib/00/00/00/00000001_sm.jpg")
+
+void tileFilename(char *buf, size_t len, const char *libPath, int32_t imageID, const char *sizeExt)
+{
+  size_t n = strlen(libPath);
+  const char *slash = (n > 0 && libPath[n-1] == '/') ? "" : "/";
+  snprintf(buf, len, "%s%s%02d/%02d/%02d/%08d_%s.jpg", libPath, slash,
+           imageID / 1000000, (imageID / 10000) % 100, (imageID / 100) % 100, imageID, sizeExt);
+}
+
+//-----------------------------------------------------------------------------
+// Reads one number from PPM header, skipping whitespace and # comment lines
+// (ImageMagick copies comments of JPEG images into them).
+// Returns: TRUE if read.
+
+int readPPMValue(FILE *in, int *value)
+{
+  int c;
+
+  while ((c = fgetc(in)) != EOF) {
+    if (c == '#') {
+      while ((c = fgetc(in)) != EOF && c != '\n') ;
+    }
+    else if (!isspace(c)) {
+      ungetc(c, in);
+      return (fscanf(in, "%d", value) == 1);
+    }
+  }
+  return FALSE;
+}
+
+//-----------------------------------------------------------------------------
+// Reads one binary PPM (P6) image from stream.
+// Returns: pixel buffer (realloc'd as needed), and width and height.
+
+uint8_t *readPPM(FILE *in, uint8_t *buf, size_t *bufSize, int *width, int *height)
+{
+  int c, maxval;
+  size_t size;
+
+  while ((c = fgetc(in)) != EOF && isspace(c)) ;
+  if (c != 'P' || fgetc(in) != '6' || !readPPMValue(in, width) || !readPPMValue(in, height) ||
+      !readPPMValue(in, &maxval)) {
+    die("PPM data not in correct format!");
+  }
+  if (maxval != 255 || *width < 1 || *height < 1) die("PPM data not 8-bit RGB!");
+  fgetc(in);  // single whitespace before pixels
+
+  size = (size_t)(*width) * (*height) * 3;
+  if (size > *bufSize) {
+    buf = (uint8_t *) realloc(buf, size);
+    if (buf == NULL) die("Could not allocate pixel buffer");
+    *bufSize = size;
+  }
+  if (fread(buf, 1, size, in) != size) die("PPM data ended early!");
+  return buf;
+}
+
+//-----------------------------------------------------------------------------
+// Appends ' ' and filename in single quotes for the shell, where each ' in it
+// becomes '\'' (e.g. it's -> 'it'\''s'). Needs room for 3 + 4 * strlen(file).
+
+void appendQuoted(char *cmd, const char *file)
+{
+  char *p = cmd + strlen(cmd);
+
+  *p++ = ' ';
+  *p++ = '\'';
+  for (; *file; file++) {
+    if (*file == '\'') { memcpy(p, "'\\''", 4); p += 4; }
+    else { *p++ = *file; }
+  }
+  *p++ = '\'';
+  *p = '\0';
+}
+
+//-----------------------------------------------------------------------------
+// Decodes a batch of tile images using a single ImageMagick run,
+// then appends them to atlas.
+
+uint8_t *addBatch(AtlasWriter *writer, int32_t *ids, char **files, int num,
+                  uint8_t *buf, size_t *bufSize)
+{
+  char *cmd;
+  size_t len = 64;
+  int i, w, h;
+  FILE *PPM;
+  sigset_t intMask, oldMask;
+
+  for (i=0; i < num; i++) { len += 4 * strlen(files[i]) + 3; }
+  cmd = (char *) malloc(len);
+  if (cmd == NULL) die("Could not allocate command line");
+  strcpy(cmd, "convert");
+  for (i=0; i < num; i++) { appendQuoted(cmd, files[i]); }
+  strcat(cmd, " -type TrueColor -depth 8 ppm:-");
+
+  // ImageMagick ignores SIGINT (ctrl-C), so the batch can finish. SIGINT is
+  // blocked meanwhile, and handled once restored.
+  sigemptyset(&intMask);
+  sigaddset(&intMask, SIGINT);
+  sigprocmask(SIG_BLOCK, &intMask, &oldMask);
+  signal(SIGINT, SIG_IGN);  // inherited by child
+  PPM = popen(cmd, "r");
+  signal(SIGINT, handleInt);
+  sigprocmask(SIG_SETMASK, &oldMask, NULL);
+  if (PPM == NULL) die("Can't fork to ImageMagick!");
+  for (i=0; i < num; i++) {
+    buf = readPPM(PPM, buf, bufSize, &w, &h);
+    atlasWriteTile(writer, ids[i], w, h, buf);
+  }
+  if (pclose(PPM) != 0) die("ImageMagick error!");
+
+  free(cmd);
+  return buf;
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+
+  // init variables
+  int e, i, s, fd, numLibTiles, numBatch, added, skipped, missing;
+  char dbFile[1024];
+  char *files[BATCH_MAX];
+  int32_t ids[BATCH_MAX];
+  int w, h;
+  uint8_t *buf = NULL;
+  size_t bufSize = 0;
+  time_t timeBegin, timeEnd;
+  struct stat statBuf;
+  TileRecord *libDB;
+  Atlas atlas;
+  AtlasWriter writer;
+
+  // process command line
+  if ( (e = cmdLine(argc, argv)) ) { return e; }
+  fprintf(stderr, "Running mkatlas...\n");
+
+  // map tile database to get imageIDs
+  snprintf(dbFile, sizeof(dbFile), "%s%smosaic.db", opt_libpath,
+           (opt_libpath[strlen(opt_libpath)-1] == '/') ? "" : "/");
+  fprintf(stderr, "Tile database: %s \n", dbFile);
+  if ((fd = open(dbFile, O_RDONLY)) < 0) die("Cannot open tile database file!");
+  if (fstat(fd, &statBuf) != 0) die("Cannot stat tile database file!");
+  numLibTiles = statBuf.st_size / sizeof(TileRecord);
+  if (numLibTiles < 1) die("Tile database is zero size!");
+  libDB = (TileRecord *) mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (libDB == MAP_FAILED) die("Cannot map tile database file!");
+  close(fd);
+
+  for (i=0; i < BATCH_MAX; i++) {
+    files[i] = (char *) malloc(1024);
+    if (files[i] == NULL) die("Could not allocate filenames");
+  }
+
+  // Handle SIGINT (ctrl-C), finishing current batch (see addBatch)
+  signal(SIGINT, handleInt);
+  timeBegin = time(NULL);
+
+  for (s=0; s < 3 && !exitFlag; s++) {
+    if (!opt_sizes[s]) continue;
+    fprintf(stderr, "Packing %s tiles into atlas...\n", sizeExts[s]);
+
+    atlasOpen(&atlas, opt_libpath, sizeExts[s]);  // existing tiles, if any
+    atlasWriterOpen(&writer, opt_libpath, sizeExts[s]);
+
+    numBatch = added = skipped = missing = 0;
+    for (i=0; i < numLibTiles && !exitFlag; i++) {
+      if (libDB[i].magic != TILE_MAGIC) die("Tile magic number invalid.");
+      if (atlasTile(&atlas, libDB[i].imageID, &w, &h) != NULL) { skipped++; continue; }
+
+      tileFilename(files[numBatch], 1024, opt_libpath, libDB[i].imageID, sizeExts[s]);
+      if (access(files[numBatch], R_OK) != 0) { missing++; continue; }
+      ids[numBatch++] = libDB[i].imageID;
+
+      if (numBatch == BATCH_MAX) {
+        buf = addBatch(&writer, ids, files, numBatch, buf, &bufSize);
+        added += numBatch;
+        numBatch = 0;
+        fprintf(stderr, "%d  (%.1f%%)\r", i, (100.0f * (i+1)/numLibTiles) );
+      }
+    }
+    if (numBatch > 0) {
+      buf = addBatch(&writer, ids, files, numBatch, buf, &bufSize);
+      added += numBatch;
+    }
+
+    atlasWriterClose(&writer);
+    atlasClose(&atlas);
+    fprintf(stderr, "\n  added:%d  already in atlas:%d  missing images:%d\n", added, skipped, missing);
+  }
+
+  timeEnd = time(NULL);
+  fprintf(stderr, "Took %.0f secs.\n", difftime(timeEnd, timeBegin) );
+  if (exitFlag) { fprintf(stderr, "Exited early. Run again to add remaining tiles.\n"); }
+
+  // free memory
+  munmap(libDB, statBuf.st_size);
+  for (i=0; i < BATCH_MAX; i++) { free(files[i]); }
+  free(buf);
+
+  return 0;
+}
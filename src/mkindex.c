@@ -0,0 +1,174 @@
+/*-----------------------------------------------------------------------------
+  mkindex.c
+  10/18/2026
+
+  Creates a sidecar attribute index of a tile database (e.g. mosaic.idx next
+  to mosaic.db), used by mosaic's -f filter option to pick a subset of the
+  library without copying it. See tileAttributes() in mosaic.h for the
+  indexed attributes.
+
+  Index file format:
+    IndexHeader
+    INDEX_COLUMNS columns of numRecords IndexEntry, each sorted by value.
+
+  Tiles appended to the database after indexing are still filtered by mosaic,
+  just without the help of the index. Run mkindex again to include them.
+  Any other change to the database is caught by its size and modified time
+  and a sample of imageIDs in IndexHeader, and mosaic refuses the index.
+
+  -----------------------------------------------------------------------------
+*/
+
+// Libraries
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "mosaic.h"
+
+//-----------------------------------------------------------------------------
+// Command Line Options
+
+// option vars
+const char *opt_dbfile = NULL;
+char *opt_outfile = NULL;
+
+int usage(const char *progname) {
+
+  fprintf(stderr, "mkindex - creates attribute index of a tile database\n");
+  fprintf(stderr, "Usage: %s [options] tile_bin.db\n", progname);
+  fprintf(stderr, "Options:\n"
+    "\t-o <index_file> : Output index file. (default=tile_bin.idx)\n"
+    "\n"
+  );
+  return 1;
+}
+
+int cmdLine(int argc, char *argv[]) {
+
+  // command line options
+  int opt;
+  while ((opt = getopt(argc, argv, "?o:")) != -1) {
+    switch (opt) {
+      case 'o':  // output index filename
+        opt_outfile = strdup(optarg);
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) return usage(argv[0]);
+  opt_dbfile = argv[optind];
+  return 0;
+}
+
+void die(char* errMsg) {
+
+  fprintf(stderr, "\nERROR: %s\n", errMsg);
+  exit(1);
+}
+
+//-----------------------------------------------------------------------------
+int compareEntries(const void *a, const void *b)
+{
+  const IndexEntry *ea = (const IndexEntry *) a;
+  const IndexEntry *eb = (const IndexEntry *) b;
+  if (ea->value != eb->value) return (ea->value < eb->value) ? -1 : 1;
+  return (ea->record < eb->record) ? -1 : (ea->record > eb->record);
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+
+  // init variables
+  int e, i, c, s, fd, numLibTiles;
+  int32_t attrs[INDEX_COLUMNS];
+  FILE *OUTFILE;
+  time_t timeBegin, timeEnd;
+  clock_t clockBegin, clockEnd;
+  double clockDiff;
+  struct stat statBuf;
+  TileRecord *libDB;
+  IndexHeader header;
+  IndexEntry *columns[INDEX_COLUMNS];
+
+  // process command line
+  if ( (e = cmdLine(argc, argv)) ) { return e; }
+  if (opt_outfile == NULL && (opt_outfile = sidecarFilename(opt_dbfile, "idx")) == NULL) {
+    die("Could not allocate filename");
+  }
+  fprintf(stderr, "Running mkindex...\n");
+
+  // map tile database
+  fprintf(stderr, "Input tile database: %s \n", opt_dbfile);
+  if ((fd = open(opt_dbfile, O_RDONLY)) < 0) die("Cannot open tile database file!");
+  if (fstat(fd, &statBuf) != 0) die("Cannot stat tile database file!");
+  numLibTiles = statBuf.st_size / sizeof(TileRecord);
+  fprintf(stderr, "  size:%lld  numTiles:%d\n", (long long)statBuf.st_size, numLibTiles);
+  if (numLibTiles < 1) die("Input tile database doesn't exist or is zero size!");
+  libDB = (TileRecord *) mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (libDB == MAP_FAILED) die("Cannot map tile database file!");
+  close(fd);
+
+  for (c=0; c < INDEX_COLUMNS; c++) {
+    columns[c] = (IndexEntry *) malloc(numLibTiles * sizeof(IndexEntry));
+    if (columns[c] == NULL) die("Could not allocate index columns");
+  }
+
+  // measure time
+  timeBegin = time(NULL);
+  clockBegin = clock();
+
+  // read attributes of every tile
+  fprintf(stderr, "Indexing Tiles...\n");
+  for (i=0; i < numLibTiles; i++) {
+    if (libDB[i].magic != TILE_MAGIC) die("Tile magic number invalid.");
+    tileAttributes(&libDB[i], attrs);
+    for (c=0; c < INDEX_COLUMNS; c++) {
+      columns[c][i].value = attrs[c];
+      columns[c][i].record = i;
+    }
+  }
+  for (c=0; c < INDEX_COLUMNS; c++) {
+    qsort(columns[c], numLibTiles, sizeof(IndexEntry), compareEntries);
+  }
+
+  // write index
+  fprintf(stderr, "Output index: %s \n", opt_outfile);
+  header.magic = INDEX_MAGIC;
+  header.numRecords = numLibTiles;
+  header.firstID = libDB[0].imageID;
+  header.lastID = libDB[numLibTiles - 1].imageID;
+  header.dbSize = statBuf.st_size;
+  header.dbTime = statBuf.st_mtime;
+  for (s=0; s < INDEX_SAMPLES; s++) {
+    header.sampleID[s] = libDB[indexSample(numLibTiles, s)].imageID;
+  }
+  if ((OUTFILE = fopen(opt_outfile, "wb")) == NULL) die("Cannot open output index file!");
+  if (fwrite(&header, sizeof(IndexHeader), 1, OUTFILE) != 1) die("Problem writing index!");
+  for (c=0; c < INDEX_COLUMNS; c++) {
+    if (fwrite(columns[c], sizeof(IndexEntry), numLibTiles, OUTFILE) != numLibTiles) die("Problem writing index!");
+  }
+  if (fclose(OUTFILE) != 0) die("Cannot close output index file!");
+
+  // print time
+  clockEnd = clock();
+  timeEnd = time(NULL);
+  clockDiff = ((double) (clockEnd - clockBegin)) / CLOCKS_PER_SEC;
+  fprintf(stderr, "Tiles indexed: %d\n", numLibTiles);
+  fprintf(stderr, "Took %.2f secs. (%.0f secs)\n", clockDiff, difftime(timeEnd, timeBegin) );
+
+  // free memory
+  munmap(libDB, statBuf.st_size);
+  for (c=0; c < INDEX_COLUMNS; c++) { free(columns[c]); }
+
+  return 0;
+}
@@ -6,7 +6,44 @@
   Description:
 
   Usage:
-    mosaic tile_bin.db < input.csv > output.csv
+    mosaic [options] tile_bin.db < input.csv > output.csv
+
+  Sequence mode (-s) reads a stream of master frames, one CSV after another,
+  and keeps the tile database mapped in memory between frames. Only master
+  positions whose blocks changed by more than the threshold are re-scored,
+  the rest reuse their candidate lists from the previous frame.
+
+  The candidate lists of every position can be saved to a cache file (-c), and
+  the mosaic written again later from the cache alone (-r), without the tile
+  database. This allows changing dups or excluding tiles (-e) in milliseconds.
+
+  With a tile database sorted by sortdb, the prune option (-p) skips whole
+  chunks of records whose chunk summary shows no tile in them could score
+  better than any tile position's current candidates. The result is the same.
+
+  The group option (-g) groups tile positions of the master image whose blocks
+  are the same, or within a tolerance score, such as areas of sky. Only the
+  first position of each group is scored, and the group shares its list of
+  candidates. With tolerance 0 the result is the same.
+
+  The threads option (-t) scores with several threads, each taking a share of
+  the tile positions. With the NUMA option (-n), on computers with more than
+  one memory node (e.g. 2 CPU sockets), the tile database is split between
+  nodes instead. Each node gets its own copy of its share of the database,
+  the master tiles and the candidate lists in its own memory, with its
+  threads kept on its CPUs. Candidates of each node are merged afterwards.
+  Both give the same result as one thread.
+
+  The memory budget option (-m) limits memory used for candidate lists, which
+  grows with the square of the number of tile positions. Positions are scored
+  in passes over the tile database, and the candidates of each pass are
+  spilled to a file in cache format. Tiles are picked at the end by reading
+  them back one position at a time, the same as replaying a cache (-r).
+
+  The input may list only some tile positions, such as a region of the master
+  image that changed. With the locked option (-l), tiles of the other positions
+  are kept from a previous mosaic CSV, and count against dups before any tile
+  is picked. Only listed positions are scored, and output has every position.
 
   Dependencies:
   * apt-get install libjudy-dev  (from universe)
@@ -29,14 +66,22 @@
 */
 
 // Libraries
+#define _GNU_SOURCE  // for CPU affinity
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>  // already in stdlib?
 #include <stdint.h>  // defines int32_t, int64_t, uint8_t
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include <Judy.h>   // requires libjudy installed, and compile flag -lJudy
 #include "mosaic.h"
@@ -105,6 +150,85 @@ CSV Output:
     (Total = 4 + 2 + 2 + 8*8*4 = 8 + 256 = 264 bytes per image)
 */
 
+//-----------------------------------------------------------------------------
+// Command Line Options
+
+#define FALSE  0
+#define TRUE   1
+#define EXCLUDED  ((Word_t) -1)   // idList value marking an excluded tile
+#define THREADS_MAX  256
+#define NODES_MAX    64
+
+// option vars
+const char *opt_dbfile = NULL;
+const char *opt_frames_out = NULL;
+int opt_seq_flag = FALSE;
+int opt_seq_score = 0;
+const char *opt_filter = NULL;
+char *opt_indexfile = NULL;
+const char *opt_cachefile = NULL;
+const char *opt_replayfile = NULL;
+int opt_topk = 0;
+int opt_dups = 0;
+int32_t *opt_exclude = NULL;
+int opt_exclude_num = 0;
+int opt_prune_flag = FALSE;
+int opt_group = -1;
+int opt_threads = 1;
+int opt_numa_flag = FALSE;
+int opt_mem_budget = 0;
+const char *opt_lockedfile = NULL;
+
+// tile position kept from previous mosaic (from -l locked option)
+typedef struct {
+  int32_t pos;
+  int32_t Ydelta;
+  int32_t ids[3];             // tile id followed by 2 alternate ids
+} LockedTile;
+
+LockedTile *opt_locked = NULL;  // sorted by pos
+int opt_locked_num = 0;
+
+// chunk summary of tile database (from -p prune option)
+typedef struct {
+  ChunkHeader *header;        // mapped chunk summary file
+  ChunkBounds *bounds;
+  size_t mapSize;
+  int32_t (*tileSums)[SUMS];  // sums of blocks of each master tile
+} LibraryChunks;
+
+// memory node and its share of the work (from -t and -n options)
+typedef struct {
+  int id;                     // node number in sysfs
+  cpu_set_t cpus;
+  int pinFlag;                // keep threads on node's CPUs
+  int copyFlag;               // node has its own copies, merged afterwards
+  int numThreads;
+  TileRecord *libDB;          // node's share of tile database
+  int firstRecord;            // record number of libDB[0] in tile database
+  int numRecords;
+  int *selList;               // node's share of selection, relative to libDB, or NULL
+  int selNum;
+  int numTiles;               // master tiles
+  TileRecord *tileImg;
+  TileScore **tileScores;     // candidates of each tile position
+} NumaNode;
+
+// one scanning thread
+typedef struct {
+  NumaNode *node;
+  int *scanList;              // tile positions scored by this thread
+  int scanNum;
+  int *positions;             // all tile positions scored
+  int numPositions;
+  TileRecord *tileImg;        // master tiles
+  int *tileRows;
+  MosaicHeader *hdr;
+  LibraryChunks *chunks;
+  int showProgress;
+  int pruned;
+} ScanThread;
+
 //-----------------------------------------------------------------------------
 void die(char* errMsg)
 {
@@ -115,7 +239,7 @@ void die(char* errMsg)
 //-----------------------------------------------------------------------------
 
 void initArrays(int numTiles, int numBlocks, TileRecord *tileImg, 
-                TileScore **tileScores)
+                TileScore **tileScores, int *tileRows)
 {
   int i, j;
 
@@ -153,7 +277,8 @@ void initArrays(int numTiles, int numBlocks, TileRecord *tileImg,
 
     // init sorted tile score matrix.
     //for (j=0; j < numTiles; j++) {
-    for (j=0; j <= i; j++) {
+    //for (j=0; j <= i; j++) {
+    for (j=0; j < tileRows[i]; j++) {
       tileScores[i][j].score = INT_MAX;
       tileScores[i][j].id = 0;
     }
@@ -163,7 +288,7 @@ void initArrays(int numTiles, int numBlocks, TileRecord *tileImg,
 //-----------------------------------------------------------------------------
 // Test: Print score/id matrix (600x600)
 
-void testPrintScores(int numTiles, TileScore **tileScores)
+void testPrintScores(int numTiles, TileScore **tileScores, int *tileRows)
 {
   int i,j;
   fprintf(stderr, "DEBUG: Outputting Score Matrix to stdout:\n");
@@ -172,7 +297,7 @@ void testPrintScores(int numTiles, TileScore **tileScores)
   for (i=0; i < numTiles; i++) {
     printf("(%d) ", i);
     //for (j=0; j < numTiles; j++) {
-    for (j=0; j <= i; j++) {
+    for (j=0; j < tileRows[i]; j++) {
       printf("%d:%d ", tileScores[i][j].id, tileScores[i][j].score);
     }
     printf("\n");
@@ -181,85 +306,130 @@ void testPrintScores(int numTiles, TileScore **tileScores)
 }
 
 
+//-----------------------------------------------------------------------------
+// Compares one master tile with a library image.
+// Returns the score, where lower is a better match.
+
+static inline int tileScore(TileRecord *libImg, TileRecord *tile, 
+                            int numBlocks, int lumFlag, int Wy, int Wc, int We)
+{
+  int j, Ydelta, score = 0;
+
+  // This runs in O(n) where n = numBlocks (e.g. 8*8 = 64 calculations per tile).
+  // idea: if const BLOCKS used instead of numBlocks, compiler could unroll j loop.
+
+  if (We) {
+    // include edge values in score
+    if (lumFlag) {
+      // use normalized Y values
+      for (j=0; j < numBlocks; j++) {
+        score +=  Wy *    abs( tile->pixel[j].Y - libImg->pixel[j].Y )
+              +   Wc * (( abs( tile->pixel[j].U - libImg->pixel[j].U ) 
+                        + abs( tile->pixel[j].V - libImg->pixel[j].V )) >> 1)
+              +   We *    abs( tile->pixel[j].E - libImg->pixel[j].E );
+      }
+    }
+    else {
+      // use original Y values
+      Ydelta = tile->Ydelta - libImg->Ydelta;
+      for (j=0; j < numBlocks; j++) {
+        score +=  Wy *    abs( tile->pixel[j].Y - libImg->pixel[j].Y + Ydelta )
+              +   Wc * (( abs( tile->pixel[j].U - libImg->pixel[j].U ) 
+                        + abs( tile->pixel[j].V - libImg->pixel[j].V )) >> 1)
+              +   We *    abs( tile->pixel[j].E - libImg->pixel[j].E );
+      }
+    }
+  }
+  else {
+    // don't include edge values in score
+    if (lumFlag) {
+      // use normalized Y values
+      for (j=0; j < numBlocks; j++) {
+        score +=  Wy *    abs( tile->pixel[j].Y - libImg->pixel[j].Y )
+              +   Wc * (( abs( tile->pixel[j].U - libImg->pixel[j].U ) 
+                        + abs( tile->pixel[j].V - libImg->pixel[j].V )) >> 1);
+      }
+    }
+    else {
+      // use original Y values
+      Ydelta = tile->Ydelta - libImg->Ydelta;
+      for (j=0; j < numBlocks; j++) {
+        score +=  Wy *    abs( tile->pixel[j].Y - libImg->pixel[j].Y + Ydelta )
+              +   Wc * (( abs( tile->pixel[j].U - libImg->pixel[j].U ) 
+                        + abs( tile->pixel[j].V - libImg->pixel[j].V )) >> 1);
+      }
+    }
+  }  // end if (We)
+
+  return score;
+}
+
+//-----------------------------------------------------------------------------
+// Returns TRUE if two master tiles are exactly the same, as scored. A score
+// of 0 isn't enough, since the color part of the score rounds down.
+// (Ydelta is only scored without LumFlag)
+
+static inline int sameTile(TileRecord *a, TileRecord *b, int numBlocks, int lumFlag)
+{
+  if (!lumFlag && a->Ydelta != b->Ydelta) return 0;
+  return memcmp(a->pixel, b->pixel, numBlocks * sizeof(TilePixel)) == 0;
+}
+
+//-----------------------------------------------------------------------------
+// Same as tileScore() but without rounding down the color part, so that any
+// difference between two master tiles adds to the score. Used for grouping.
+
+static inline int groupScore(TileRecord *a, TileRecord *b,
+                             int numBlocks, int lumFlag, int Wy, int Wc, int We)
+{
+  int j, score = 0;
+  int Ydelta = (lumFlag) ? 0 : b->Ydelta - a->Ydelta;
+
+  for (j=0; j < numBlocks; j++) {
+    score +=  Wy *  abs( b->pixel[j].Y - a->pixel[j].Y + Ydelta )
+          +   Wc * (abs( b->pixel[j].U - a->pixel[j].U )
+                  + abs( b->pixel[j].V - a->pixel[j].V ))
+          +   We *  abs( b->pixel[j].E - a->pixel[j].E );
+  }
+  return score;
+}
+
 //-----------------------------------------------------------------------------
 // Processing a single library image.
 // Finds best match for each tile position for a single library image.
 
 /*
   Input:
-    numTiles <= Xtiles * Ytiles;  // numTiles can be less because some tiles may be pre-filled
+    scanList = list of tile positions to process, or NULL for the first scanNum positions.
+    scanNum  = number of positions to process (<= Xtiles * Ytiles).
     numBlocks = blocks per tile (default = 8*8 = 64)
     LumFlag = { 0 = original tiles, 1 = adjust tile brightness }
     Wy =  luma weight (default = 1)
     Wc = color weight (default = 1)
     We =  edge weight (default = 0)
-    dups = number of times a tile may be duplicated in mosaic. 
+    tileRows = number of scores kept in each tileScores[i], which is at least
+          i / dups + 1, where dups = number of times a tile may be duplicated in mosaic.
           (e.g. 1 = all tiles unique; 600 = may use same tile in every position in a 30x20 mosaic.)
 */
 
 void processLibImg(TileRecord *libImg, TileRecord *tileImg, 
-                    TileScore **tileScores,
-                    int numTiles, int numBlocks, int lumFlag, int Wy, int Wc, int We, int dups)
+                    TileScore **tileScores, int *scanList, int scanNum,
+                    int numBlocks, int lumFlag, int Wy, int Wc, int We, int *tileRows)
 {
-  int score, Ydelta;
-  int i, j, k;
-  int dupCount = dups;
+  int score;
+  int i, j, k, n;
   //int shiftFlag;
   //TileScore shiftScore = {0, 0};
   //TileScore tempScore  = {0, 0};
 
   // Loop thru all tiles in master image. (e.g. 20*30 = 600)
-  k=0;  // k is last index in tileScores, and increments
-  for (i=0; i < numTiles; i++) {
-    score = 0;
+  for (n=0; n < scanNum; n++) {
+    i = (scanList) ? scanList[n] : n;
+    k = tileRows[i] - 1;  // k is last index in tileScores[i]  (idea #2)
 
     // Compare tile with library image.
     // This runs in O(n) where n = numBlocks * numTiles (e.g. 8*8 = 64 * 600 = 38,400 calculations per libImg).
-    // idea: if const BLOCKS used instead of numBlocks, compiler could unroll j loop.
-    // idea: moving if statements outside for i loop would eliminate 2*600 branches.
-
-    if (We) {
-      // include edge values in score
-      if (lumFlag) {
-        // use normalized Y values
-        for (j=0; j < numBlocks; j++) {
-          score +=  Wy *    abs( tileImg[i].pixel[j].Y - libImg->pixel[j].Y )
-                +   Wc * (( abs( tileImg[i].pixel[j].U - libImg->pixel[j].U ) 
-                          + abs( tileImg[i].pixel[j].V - libImg->pixel[j].V )) >> 1)
-                +   We *    abs( tileImg[i].pixel[j].E - libImg->pixel[j].E );
-        }
-      }
-      else {
-        // use original Y values
-        Ydelta = tileImg[i].Ydelta - libImg->Ydelta;
-        for (j=0; j < numBlocks; j++) {
-          score +=  Wy *    abs( tileImg[i].pixel[j].Y - libImg->pixel[j].Y + Ydelta )
-                +   Wc * (( abs( tileImg[i].pixel[j].U - libImg->pixel[j].U ) 
-                          + abs( tileImg[i].pixel[j].V - libImg->pixel[j].V )) >> 1)
-                +   We *    abs( tileImg[i].pixel[j].E - libImg->pixel[j].E );
-        }
-      }
-    }
-    else {
-      // don't include edge values in score
-      if (lumFlag) {
-        // use normalized Y values
-        for (j=0; j < numBlocks; j++) {
-          score +=  Wy *    abs( tileImg[i].pixel[j].Y - libImg->pixel[j].Y )
-                +   Wc * (( abs( tileImg[i].pixel[j].U - libImg->pixel[j].U ) 
-                          + abs( tileImg[i].pixel[j].V - libImg->pixel[j].V )) >> 1);
-        }
-      }
-      else {
-        // use original Y values
-        Ydelta = tileImg[i].Ydelta - libImg->Ydelta;
-        for (j=0; j < numBlocks; j++) {
-          score +=  Wy *    abs( tileImg[i].pixel[j].Y - libImg->pixel[j].Y + Ydelta )
-                +   Wc * (( abs( tileImg[i].pixel[j].U - libImg->pixel[j].U ) 
-                          + abs( tileImg[i].pixel[j].V - libImg->pixel[j].V )) >> 1);
-        }
-      }
-    }  // end if (Wc > 0)
+    score = tileScore(libImg, &tileImg[i], numBlocks, lumFlag, Wy, Wc, We);
 
     // Insert score into tileScores[][] using insert sort. (lowest to highest score)
     // This previously ran in O(n) where n = numTiles (e.g. 20*30 = 600 * 600 < 360,000 array accesses per libImg).
@@ -310,15 +480,44 @@ void processLibImg(TileRecord *libImg, TileRecord *tileImg,
       tileScores[i][j].id = libImg->imageID;
     } // end if
 
-    if ((--dupCount) == 0) { dupCount = dups; k++; }  // idea #2
-  } // next i
+  } // next n
 
 } // end function
 
+//-----------------------------------------------------------------------------
+// Read first line of CSV from given file stream.
+// Returns: 1 if read, 0 at end of file. (dies if incorrectly formatted)
+
+int readHeaderCSV(FILE *in, MosaicHeader *hdr)
+{
+  int temp = fscanf(in, " %d , %d , %d, %d , %d , %d , %d , %d , %d ", 
+                &hdr->Xtiles, &hdr->Ytiles, &hdr->Xblocks, &hdr->Yblocks, &hdr->flags, 
+                &hdr->Wy, &hdr->Wc, &hdr->We, &hdr->dups);
+  if (temp == EOF) return 0;
+  if (temp != 9) die("CSV first line missing values or incorrectly formatted!");
+  if (hdr->Xtiles < 1 || hdr->Ytiles < 1 || hdr->Xblocks * hdr->Yblocks > BLOCKS || hdr->dups < 1) {
+    die("CSV first line has invalid values!");
+  }
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+// Clears a row of tileScores so that it can be scored again.
+
+void resetScores(TileScore *scores, int num)
+{
+  int j;
+  for (j=0; j < num; j++) {
+    scores[j].score = INT_MAX;
+    scores[j].id = 0;
+  }
+}
+
 //-----------------------------------------------------------------------------
 // Read Master Image Tiles in CSV format from given file stream.
-// Returns: TileRecord tileImg[]
-// (done, not tested)
+// Reads upto numTiles tiles, or less if end of file reached first, since only
+// some tile positions may be listed (see -l locked option).
+// Returns: TileRecord tileImg[], and number of tiles read.
 
 /*
 CSV Input:  (where n = numBlocks = 64; N = numTiles <= 600)
@@ -328,9 +527,9 @@ CSV Input:  (where n = numBlocks = 64; N = numTiles <= 600)
   ...
   posN, YdeltaN, ...
 */
-// TODO: [ ] MUST Handle EOF case before numTiles reached!
+// [X] Handle EOF case before numTiles reached!
 
-void readTilesFromCSV(FILE *in , int numTiles, int numBlocks, TileRecord *tileImg )
+int readTilesFromCSV(FILE *in , int numTiles, int numBlocks, TileRecord *tileImg )
 {
   int i, j, temp, t1, t2, t3, t4;
 
@@ -338,6 +537,7 @@ void readTilesFromCSV(FILE *in , int numTiles, int numBlocks, TileRecord *tileIm
     // fprintf(stderr, "(i=%d) ", i);  // ** TEST **
     tileImg[i].magic = 0;
     temp = fscanf(in, " %d , %d ", &t1, &t2);
+    if (temp == EOF) break;
     if (temp != 2) die("CSV input missing values or incorrectly formatted! (first 2)");
     tileImg[i].imageID = t1;
     tileImg[i].Ydelta  = t2;
@@ -355,6 +555,61 @@ void readTilesFromCSV(FILE *in , int numTiles, int numBlocks, TileRecord *tileIm
 
   } // next i
 
+  return i;
+}
+
+//-----------------------------------------------------------------------------
+// Reads tile positions of a previous mosaic CSV (from -l locked option) that
+// aren't listed in master image, to be kept as they are. Master tiles must be
+// listed in order of position, so they can be merged when output.
+// Returns: opt_locked[] sorted by position, and opt_locked_num.
+
+int compareLocked(const void *a, const void *b)
+{
+  return ((const LockedTile *) a)->pos - ((const LockedTile *) b)->pos;
+}
+
+void readLockedTiles(const char *lockedFile, MosaicHeader *hdr, TileRecord *tileImg, int numTiles)
+{
+  int i, temp, maxLocked = 0, maxPos = hdr->Xtiles * hdr->Ytiles;
+  char *listed;
+  FILE *LOCKED;
+  MosaicHeader prev;
+  LockedTile tile;
+
+  fprintf(stderr, "Reading locked tiles: %s \n", lockedFile);
+  if ((LOCKED = fopen(lockedFile, "r")) == NULL) die("Cannot open locked tiles file!");
+  if (!readHeaderCSV(LOCKED, &prev)) die("Locked tiles file is empty!");
+  if (prev.Xtiles != hdr->Xtiles || prev.Ytiles != hdr->Ytiles) {
+    die("Locked tiles file is for a mosaic of different size!");
+  }
+
+  listed = (char *) calloc(maxPos, sizeof(char));
+  if (listed == NULL) die("Could not init locked positions");
+  for (i=0; i < numTiles; i++) {
+    if (tileImg[i].imageID < 0 || tileImg[i].imageID >= maxPos) die("CSV input tile position out of range!");
+    if (i > 0 && tileImg[i].imageID <= tileImg[i-1].imageID) die("CSV input tile positions must be in order with -l!");
+    listed[tileImg[i].imageID] = 1;
+  }
+
+  while ((temp = fscanf(LOCKED, " %d , %d , %d , %d , %d ", &tile.pos, &tile.Ydelta,
+                        &tile.ids[0], &tile.ids[1], &tile.ids[2])) == 5) {
+    if (tile.pos < 0 || tile.pos >= maxPos) die("Locked tile position out of range!");
+    if (listed[tile.pos]) continue;  // re-scored, or listed twice
+    listed[tile.pos] = 1;
+    if (opt_locked_num == maxLocked) {
+      maxLocked = (maxLocked) ? maxLocked * 2 : 1024;
+      opt_locked = (LockedTile *) realloc(opt_locked, maxLocked * sizeof(LockedTile));
+      if (opt_locked == NULL) die("Could not allocate locked tiles");
+    }
+    opt_locked[opt_locked_num++] = tile;
+  }
+  if (temp != EOF) die("Locked tiles file missing values or incorrectly formatted!");
+  qsort(opt_locked, opt_locked_num, sizeof(LockedTile), compareLocked);
+
+  fprintf(stderr, "  locked:%d  re-scored:%d  of %d tiles\n", opt_locked_num, numTiles, maxPos);
+  free(listed);
+  fclose(LOCKED);
 }
 
 //-----------------------------------------------------------------------------
@@ -371,75 +626,158 @@ CSV Output:
 */
 // NOTE: Where to get the Ydelta values???
 
+//-----------------------------------------------------------------------------
+// Returns id of candidate j in a row of tileScores. Candidates past the end of
+// the row were never scored, and read as id 0.
+
+static inline int32_t candidateID(TileScore *row, int rowLen, int j)
+{
+  return (j < rowLen) ? row[j].id : 0;
+}
+
+// Returns number of candidates of position i used for given dups. Extra
+// candidates kept for the cache (-k) are ignored, so output is the same as
+// if scored with this dups.
+
+static inline int candidatesUsed(int rowLen, int i, int dups)
+{
+  return (i / dups + 1 < rowLen) ? i / dups + 1 : rowLen;
+}
+
+//-----------------------------------------------------------------------------
+// Picks the tile for position i from its row of candidates (lowest score
+// first), skipping tiles already used dups times, as counted in idList.
+// Returns: ids[] = chosen tile id followed by 2 alternate ids.
+
+void assignTile(Pvoid_t *idList, TileScore *row, int rowLen, int i, int dups, int32_t *ids)
+{
+  int j=0;
+  Word_t   index;     // array index
+  Word_t *pvalue;   // pointer to array element value
+
+  while(j <= i) {
+    ids[0] = candidateID(row, rowLen, j);
+    ids[1] = (j + 1 <= i) ? candidateID(row, rowLen, j + 1) : -1;
+    ids[2] = (j + 2 <= i) ? candidateID(row, rowLen, j + 2) : -1;
+    //index = (Word_t) id;
+    index = (Word_t) abs(ids[0]);    // taking abs() removes vflip duplicate ** BUG! **
+    // Part of FIX is to double the num of scores per tile, but still have to figure this out. (WRONG)
+    // REAL FIX: place flip in score calculation, compare flipped w/ non-flipped score, then do 1 insert sort.
+    // Must do this in processLibImg(), only call this once! (unlike the 2nd call done now)
+
+    JLG(pvalue, *idList, index);  // JudyLGet()
+    if (pvalue != NULL) {
+      if (*pvalue < dups) {
+        *pvalue += 1;
+        break;  // exit while loop
+      }
+      // else continue loop
+    }
+    else {
+      // insert a new value into Judy array
+      JLI(pvalue, *idList, index);  // JudyLIns()
+      if (pvalue == PJERR) { die("Judy malloc() error!"); }
+      *pvalue = 1;   // store new value
+      break;   // exit while loop
+    }
+    j++;
+  }
+
+  // no candidates left, but never use an excluded tile
+  if (j > i) {
+    JLG(pvalue, *idList, (Word_t) abs(ids[0]));  // JudyLGet()
+    if (pvalue != NULL && *pvalue == EXCLUDED) { ids[0] = 0; }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Returns new Judy array of tile ids marked as excluded, so that they're
+// never picked (from -e exclude option), and of tiles already used by locked
+// tile positions, counted against dups (from -l locked option).
+
+Pvoid_t usedTiles(void)
+{
+  int n;
+  Pvoid_t idList = (Pvoid_t) NULL;  // JudyL array (Judy.h required)
+  Word_t *pvalue;
+
+  for (n=0; n < opt_exclude_num; n++) {
+    JLI(pvalue, idList, (Word_t) abs(opt_exclude[n]));  // JudyLIns()
+    if (pvalue == PJERR) { die("Judy malloc() error!"); }
+    *pvalue = EXCLUDED;
+  }
+  for (n=0; n < opt_locked_num; n++) {
+    if (opt_locked[n].ids[0] == 0) continue;  // no tile
+    JLI(pvalue, idList, (Word_t) abs(opt_locked[n].ids[0]));  // JudyLIns()
+    if (pvalue == PJERR) { die("Judy malloc() error!"); }
+    if (*pvalue != EXCLUDED) *pvalue += 1;
+  }
+  return idList;
+}
+
+// Writes locked tile positions before tile position pos, continuing from
+// locked tile *next, so that output stays in order of position.
+
+void writeLockedTiles(FILE *outfile, int *next, int pos)
+{
+  LockedTile *tile;
+  for (; *next < opt_locked_num && opt_locked[*next].pos < pos; (*next)++) {
+    tile = &opt_locked[*next];
+    fprintf(outfile, "%d,%d,%d,%d,%d\n", tile->pos, tile->Ydelta, tile->ids[0], tile->ids[1], tile->ids[2]);
+  }
+}
+
+void writeHeader(FILE *outfile, MosaicHeader *hdr)
+{
+  fprintf(outfile, "%d,%d,%d,%d,%d,%d,%d,%d,%d\n", hdr->Xtiles, hdr->Ytiles, hdr->Xblocks, hdr->Yblocks, 
+          hdr->flags, hdr->Wy, hdr->Wc, hdr->We, hdr->dups);
+}
+
 void writeTiles( FILE *outfile, int numTiles, int dups, 
-                 TileScore **tileScores, TileRecord *tileImg )
+                 TileScore **tileScores, int *tileRows, TileRecord *tileImg )
 {
-  int i, j, id=0, pos=0, y=0;
-  int id2=-1, id3=-1;  // alternate ids
+  int i, k, num, pos=0, y=0, next=0;
+  int32_t ids[3];
 
   // init Judy array
-  Pvoid_t idList = (Pvoid_t) NULL;  // JudyL array (Judy.h required)
-  Word_t   index;     // array index
+  Pvoid_t idList;   // JudyL array (Judy.h required)
   Word_t   value;    // array element value
-  Word_t *pvalue;   // pointer to array element value
-  //int      Rc_int;   // return code  (is this used??)
 
 
-  if (numTiles == dups) {
+  if (numTiles + opt_locked_num == dups && opt_exclude_num == 0) {
     // output all best matching tiles, including all duplicates
     for (i=0; i < numTiles; i++) {
-      id = tileScores[i][0].id;
-      id2 = (i >= 1) ? tileScores[i][1].id : -1;
-      id3 = (i >= 2) ? tileScores[i][2].id : -1;
+      k = i + opt_locked_num;  // number of tiles placed before this one
+      num = candidatesUsed(tileRows[i], k, dups);
+      ids[0] = candidateID(tileScores[i], num, 0);
+      ids[1] = (k >= 1) ? candidateID(tileScores[i], num, 1) : -1;
+      ids[2] = (k >= 2) ? candidateID(tileScores[i], num, 2) : -1;
       pos = tileImg[i].imageID;
       y = tileImg[i].Ydelta;   // TODO: change this
-      fprintf(outfile, "%d,%d,%d,%d,%d\n", pos, y, id, id2, id3);
+      writeLockedTiles(outfile, &next, pos);
+      fprintf(outfile, "%d,%d,%d,%d,%d\n", pos, y, ids[0], ids[1], ids[2]);
     }
   }
   else {
     // output tiles upto dups duplicate tiles (DONE, TEST #1 OK)
     //fprintf(stderr, "  writeTiles()  numTiles:%d  dups:%d \n", numTiles, dups);  // ** TEST **
 
+    idList = usedTiles();
     for (i=0; i < numTiles; i++) {
+      k = i + opt_locked_num;
       pos = tileImg[i].imageID;
       y = tileImg[i].Ydelta;   // TODO: change this
-
-      j=0;
-      while(j <= i) {
-        id = tileScores[i][j].id;
-        id2 = (j + 1 <= i) ? tileScores[i][j + 1].id : -1;
-        id3 = (j + 2 <= i) ? tileScores[i][j + 2].id : -1;
-        //index = (Word_t) id;
-        index = (Word_t) abs(id);    // taking abs() removes vflip duplicate ** BUG! **
-        // Part of FIX is to double the num of scores per tile, but still have to figure this out. (WRONG)
-        // REAL FIX: place flip in score calculation, compare flipped w/ non-flipped score, then do 1 insert sort.
-        // Must do this in processLibImg(), only call this once! (unlike the 2nd call done now)
-
-        JLG(pvalue, idList, index);  // JudyLGet()
-        if (pvalue != NULL) {
-          if (*pvalue < dups) {
-            *pvalue += 1;
-            break;  // exit while loop
-          }
-          // else continue loop
-        }
-        else {
-          // insert a new value into Judy array
-          JLI(pvalue, idList, index);  // JudyLIns()
-          if (pvalue == PJERR) { die("Judy malloc() error!"); }
-          *pvalue = 1;   // store new value
-          break;   // exit while loop
-        }
-        j++;
-      }
-
-      fprintf(outfile, "%d,%d,%d,%d,%d\n", pos, y, id, id2, id3);
+      num = candidatesUsed(tileRows[i], k, dups);
+      assignTile(&idList, tileScores[i], num, k, dups, ids);
+      writeLockedTiles(outfile, &next, pos);
+      fprintf(outfile, "%d,%d,%d,%d,%d\n", pos, y, ids[0], ids[1], ids[2]);
     }
 
     JLFA(value, idList);  // JudyLFreeArray()
     //fprintf(stderr, "  writeTiles()  idList bytes freed:%d \n", (int)value);  // ** TEST **
 
   }  // end if
+  writeLockedTiles(outfile, &next, INT_MAX);
 
 }
 //
@@ -467,10 +805,1245 @@ void flipTileVertically(TileRecord *libImg, int Xblocks, int Yblocks) {
 }
 
 //-----------------------------------------------------------------------------
-void usage()
+// Groups master tile positions that score within tolerance of the first
+// position of a group (the rep), using groupScore(). A tolerance of 0 only
+// groups positions that are exactly the same. Positions are put in buckets by mean Y, U, V
+// and only compared to reps in the same bucket. Each group shares the rep's
+// row of tileScores, long enough for every member, which must only be freed
+// once (where groupRep[i] == i).
+// Returns: list of reps to score, and number of reps in numGroups.
+
+int *groupTiles(TileRecord *tileImg, TileScore **tileScores, int *tileRows, int numTiles,
+                MosaicHeader *hdr, int tolerance, int *groupRep, int *numGroups)
 {
-  fprintf(stderr, "Usage: mosaic tile_bin.db < input.csv > output.csv \n");
-  exit(1);
+  int i, r, ySum;
+  int numBlocks = hdr->Xblocks * hdr->Yblocks;
+  int lumFlag = (hdr->flags & 0x01);
+  int *reps, *nextRep;
+  int32_t sums[SUMS];
+  Pvoid_t buckets = (Pvoid_t) NULL;  // JudyL array of first rep in each bucket
+  Word_t key, value, *pvalue;
+
+  reps = (int *) malloc(numTiles * sizeof(int));
+  nextRep = (int *) malloc(numTiles * sizeof(int));  // next rep in same bucket, or -1
+  if (reps == NULL || nextRep == NULL) die("Could not init groups");
+  ySum = (lumFlag) ? SUM_Y : SUM_YA;
+  *numGroups = 0;
+
+  for (i=0; i < numTiles; i++) {
+    // bucket of mean Y, U, V (8 levels each)
+    tileSums(&tileImg[i], numBlocks, sums);
+    key = ((Word_t)((sums[ySum] / numBlocks + 256) >> 3) << 16)
+        | ((Word_t)((sums[SUM_U] / numBlocks) >> 3) << 8) | (Word_t)((sums[SUM_V] / numBlocks) >> 3);
+
+    JLG(pvalue, buckets, key);  // JudyLGet()
+    for (r = (pvalue) ? (int)*pvalue : -1; r >= 0; r = nextRep[r]) {
+      if ((tolerance == 0) ? sameTile(&tileImg[r], &tileImg[i], numBlocks, lumFlag)
+          : groupScore(&tileImg[r], &tileImg[i], numBlocks, lumFlag, hdr->Wy, hdr->Wc, hdr->We) <= tolerance) break;
+    }
+    if (r >= 0) {
+      // join group, making shared row long enough
+      groupRep[i] = r;
+      if (tileRows[i] > tileRows[r]) tileRows[r] = tileRows[i];
+    }
+    else {
+      // new group, first in bucket
+      groupRep[i] = i;
+      nextRep[i] = (pvalue) ? (int)*pvalue : -1;
+      JLI(pvalue, buckets, key);  // JudyLIns()
+      if (pvalue == PJERR) { die("Judy malloc() error!"); }
+      *pvalue = i;
+      reps[(*numGroups)++] = i;
+    }
+  }
+  JLFA(value, buckets);  // JudyLFreeArray()
+
+  // share rows
+  for (i=0; i < numTiles; i++) {
+    r = groupRep[i];
+    if (r == i) {
+      tileScores[i] = (TileScore *) realloc(tileScores[i], tileRows[i] * sizeof(TileScore));
+      if (tileScores[i] == NULL) die("Could not init tileScores[i]");
+      resetScores(tileScores[i], tileRows[i]);
+    }
+    else {
+      free(tileScores[i]);
+      tileScores[i] = tileScores[r];
+      tileRows[i] = tileRows[r];
+    }
+  }
+
+  free(nextRep);
+  return reps;
+}
+
+//-----------------------------------------------------------------------------
+// Returns lowest score any tile within chunk bounds could get at position i,
+// since the sum of differences of blocks is at least the difference of sums.
+//   Y:    sum |Ym - Yt| >= |sum Ym - sum Yt|
+//   U, V: sum (|Um - Ut| + |Vm - Vt|) >> 1 >= (|sum Um - sum Ut| + |sum Vm - sum Vt| - numBlocks) / 2
+
+static inline int32_t sumDistance(int32_t sum, int32_t min, int32_t max)
+{
+  return (sum < min) ? min - sum : ((sum > max) ? sum - max : 0);
+}
+
+int chunkLowestScore(ChunkBounds *bounds, int32_t *sums, int numBlocks, int lumFlag, int Wy, int Wc)
+{
+  int ySum = (lumFlag) ? SUM_Y : SUM_YA;
+  int32_t dY, dC;
+
+  dY = sumDistance(sums[ySum], bounds->min[ySum], bounds->max[ySum]);
+  dC = sumDistance(sums[SUM_U], bounds->min[SUM_U], bounds->max[SUM_U])
+     + sumDistance(sums[SUM_V], bounds->min[SUM_V], bounds->max[SUM_V]) - numBlocks;
+  return Wy * dY + ((dC > 0) ? Wc * ((dC + 1) / 2) : 0);
+}
+
+// Returns TRUE if no tile in chunk can be added to the candidates of any listed position.
+
+int chunkPruned(LibraryChunks *chunks, int c, TileScore **tileScores, int *tileRows,
+                int *scanList, int scanNum, MosaicHeader *hdr)
+{
+  int i, n;
+  int numBlocks = hdr->Xblocks * hdr->Yblocks;
+  int lumFlag = (hdr->flags & 0x01);
+
+  for (n=0; n < scanNum; n++) {
+    i = (scanList) ? scanList[n] : n;
+    if (chunkLowestScore(&chunks->bounds[c], chunks->tileSums[i], numBlocks, lumFlag, hdr->Wy, hdr->Wc)
+        < tileScores[i][tileRows[i] - 1].score) return FALSE;
+  }
+  return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Computes block sums of listed master tiles (or first scanNum if NULL),
+// needed before scanning with chunks.
+
+void chunkTileSums(LibraryChunks *chunks, TileRecord *tileImg, int *scanList, int scanNum, MosaicHeader *hdr)
+{
+  int i, n;
+  for (n=0; n < scanNum; n++) {
+    i = (scanList) ? scanList[n] : n;
+    tileSums(&tileImg[i], hdr->Xblocks * hdr->Yblocks, chunks->tileSums[i]);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Scores every record in the tile database against the listed tile positions,
+// or the first scanNum positions if scanList is NULL. libDB is the entire tile
+// database mapped into memory, or part of it starting at record number
+// firstRecord.
+// selList is list of record numbers to score (from -f filter), or NULL for all.
+// chunks is chunk summary of tile database (from -p prune), or NULL.
+// Returns: number of chunks skipped.
+
+int scanLibrary(TileRecord *libDB, int firstRecord, int numLibTiles, int *selList, int selNum,
+                TileRecord *tileImg, TileScore **tileScores, int *tileRows, int *scanList, int scanNum,
+                MosaicHeader *hdr, LibraryChunks *chunks, int showProgress)
+{
+  int i, n, c, lastChunk = -1, skipChunk = FALSE, pruned = 0;
+  int numBlocks = hdr->Xblocks * hdr->Yblocks;
+  int lumFlag   = (hdr->flags & 0x01);
+  int vflipFlag = (hdr->flags & 0x02) >> 1;
+  TileRecord libImg;
+
+  if (selList == NULL) selNum = numLibTiles;
+
+  for (n=0; n < selNum; n++) {
+    i = (selList) ? selList[n] : n;
+
+    // check each chunk when reached, skipping rest of its records if pruned
+    if (chunks) {
+      c = firstRecord + i;
+      c = (c < chunks->header->numRecords) ? c / chunks->header->chunkSize : -1;
+      if (c != lastChunk) {
+        lastChunk = c;
+        skipChunk = (c >= 0) && chunkPruned(chunks, c, tileScores, tileRows, scanList, scanNum, hdr);
+        if (skipChunk) pruned++;
+      }
+      if (skipChunk) continue;
+    }
+
+    // output current tile record number followed by CR to keep cursor on same line
+    // skip every 10
+    if (showProgress && (n % 10) == 0) {
+      fprintf(stderr, "%d  (%.1f%%)\r", n, (100.0f * (n+1)/selNum) );
+    }
+
+    // copy a tile one at a time (flipping modifies it)
+    libImg = libDB[i];
+
+    // process one tile at a time
+    if (libImg.magic != TILE_MAGIC) die("Tile magic number invalid.");
+    processLibImg(&libImg, tileImg, tileScores, scanList, scanNum, 
+                  numBlocks, lumFlag, hdr->Wy, hdr->Wc, hdr->We, tileRows);
+
+    if (vflipFlag) {   // ** DONE, NOT TESTED **
+      // flip the lib tile vertically, then process again
+      flipTileVertically(&libImg, hdr->Xblocks, hdr->Yblocks);
+      processLibImg(&libImg, tileImg, tileScores, scanList, scanNum, 
+                    numBlocks, lumFlag, hdr->Wy, hdr->Wc, hdr->We, tileRows);
+    }
+  }
+  return pruned;
+}
+
+//-----------------------------------------------------------------------------
+// Reads CPUs of each memory node from sysfs (e.g. "0-7,16-23"), keeping only
+// CPUs this process may run on. Falls back to a single node of those CPUs.
+// Returns: number of nodes.
+
+int compareNodes(const void *a, const void *b)
+{
+  return ((const NumaNode *) a)->id - ((const NumaNode *) b)->id;
+}
+
+int numaNodes(NumaNode *nodes, int maxNodes)
+{
+  int numNodes = 0, id, lo, hi, cpu, k;
+  char path[1024], list[4096], *item, *save = NULL;
+  cpu_set_t allowed;
+  DIR *dir;
+  struct dirent *entry;
+  FILE *CPULIST;
+
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) die("Cannot get CPU affinity!");
+
+  if ((dir = opendir("/sys/devices/system/node")) != NULL) {
+    while ((entry = readdir(dir)) != NULL && numNodes < maxNodes) {
+      if (sscanf(entry->d_name, "node%d", &id) != 1) continue;
+      snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+      if ((CPULIST = fopen(path, "r")) == NULL) continue;
+      if (fgets(list, sizeof(list), CPULIST) == NULL) list[0] = '\0';
+      fclose(CPULIST);
+
+      memset(&nodes[numNodes], 0, sizeof(NumaNode));
+      nodes[numNodes].id = id;
+      for (item = strtok_r(list, ",\n", &save); item != NULL; item = strtok_r(NULL, ",\n", &save)) {
+        k = sscanf(item, "%d-%d", &lo, &hi);
+        if (k < 1) continue;
+        if (k == 1) hi = lo;
+        for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+          if (CPU_ISSET(cpu, &allowed)) CPU_SET(cpu, &nodes[numNodes].cpus);
+        }
+      }
+      save = NULL;
+      if (CPU_COUNT(&nodes[numNodes].cpus) > 0) numNodes++;  // skip nodes with only memory
+    }
+    closedir(dir);
+  }
+
+  if (numNodes == 0) {
+    memset(&nodes[0], 0, sizeof(NumaNode));
+    nodes[0].cpus = allowed;
+    numNodes = 1;
+  }
+  qsort(nodes, numNodes, sizeof(NumaNode), compareNodes);
+  return numNodes;
+}
+
+//-----------------------------------------------------------------------------
+// Splits the selected records of tile database between nodes in order, so
+// that merging candidates of nodes in order gives the same result as one scan.
+
+void splitLibrary(NumaNode *nodes, int numNodes, TileRecord *libDB, int numLibTiles,
+                  int *selList, int selNum)
+{
+  int n, k, first, last, begin = 0, end;
+
+  if (selList == NULL) selNum = numLibTiles;
+  for (n=0; n < numNodes; n++) {
+    end = (int)((int64_t)selNum * (n + 1) / numNodes);
+    nodes[n].selNum = end - begin;
+    nodes[n].libDB = libDB;
+    nodes[n].numRecords = numLibTiles;
+    nodes[n].selList = NULL;
+    if (nodes[n].copyFlag) {
+      // node gets records from first to last of its share
+      first = (end == begin) ? 0 : ((selList) ? selList[begin] : begin);
+      last = (end == begin) ? -1 : ((selList) ? selList[end - 1] : end - 1);
+      nodes[n].firstRecord = first;
+      nodes[n].numRecords = last - first + 1;
+      if (selList) {
+        nodes[n].selList = (int *) malloc((nodes[n].selNum + 1) * sizeof(int));
+        if (nodes[n].selList == NULL) die("Could not init node selection");
+        for (k=0; k < nodes[n].selNum; k++) { nodes[n].selList[k] = selList[begin + k] - first; }
+      }
+    }
+    else if (selList) {
+      nodes[n].selList = selList + begin;
+    }
+    else {
+      nodes[n].firstRecord = begin;
+      nodes[n].libDB = libDB + begin;
+      nodes[n].numRecords = end - begin;
+    }
+    begin = end;
+  }
+}
+
+// Copies node's share of tile database into node's memory. Run from thread on node.
+
+void *copyNodeLibrary(void *arg)
+{
+  NumaNode *node = (NumaNode *) arg;
+  TileRecord *share = node->libDB + node->firstRecord;
+
+  if (node->pinFlag) pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node->cpus);
+  node->libDB = (TileRecord *) malloc(((size_t)node->numRecords + 1) * sizeof(TileRecord));
+  if (node->libDB == NULL) die("Could not allocate node tile database");
+  memcpy(node->libDB, share, (size_t)node->numRecords * sizeof(TileRecord));  // first touch on node
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Copies master tiles into node's memory, and clears node's candidates of
+// every position scored. Run from first thread of node.
+
+void *prepareNode(void *arg)
+{
+  ScanThread *job = (ScanThread *) arg;
+  NumaNode *node = job->node;
+  int n, i;
+
+  if (node->pinFlag) pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node->cpus);
+  if (node->tileImg == NULL) {
+    node->tileImg = (TileRecord *) malloc(node->numTiles * sizeof(TileRecord));
+    node->tileScores = (TileScore **) calloc(node->numTiles, sizeof(TileScore *));
+    if (node->tileImg == NULL || node->tileScores == NULL) die("Could not allocate node tiles");
+  }
+  memcpy(node->tileImg, job->tileImg, node->numTiles * sizeof(TileRecord));
+
+  for (n=0; n < job->numPositions; n++) {
+    i = job->positions[n];
+    if (node->tileScores[i] == NULL) {
+      node->tileScores[i] = (TileScore *) malloc(job->tileRows[i] * sizeof(TileScore));
+      if (node->tileScores[i] == NULL) die("Could not allocate node tileScores");
+    }
+    resetScores(node->tileScores[i], job->tileRows[i]);
+  }
+  return NULL;
+}
+
+void *scanThread(void *arg)
+{
+  ScanThread *job = (ScanThread *) arg;
+  NumaNode *node = job->node;
+
+  if (node->pinFlag) pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node->cpus);
+  job->pruned = scanLibrary(node->libDB, node->firstRecord, node->numRecords, node->selList, node->selNum,
+                            node->tileImg, node->tileScores, job->tileRows, job->scanList, job->scanNum,
+                            job->hdr, job->chunks, job->showProgress);
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Same as scanLibrary(), using threads of each node. Each thread of a node
+// scores a share of the listed tile positions against the node's share of
+// the tile database. When nodes have their own candidates, they're merged in
+// node order, lower node first on equal scores, the same as one scan.
+// Returns: number of chunks skipped by all threads.
+
+int scanThreaded(NumaNode *nodes, int numNodes, TileRecord *tileImg, TileScore **tileScores, int *tileRows,
+                 int *scanList, int scanNum, MosaicHeader *hdr, LibraryChunks *chunks)
+{
+  pthread_t threads[THREADS_MAX];
+  ScanThread jobs[THREADS_MAX];
+  int firstJob[NODES_MAX], next[NODES_MAX];
+  int n, t, k, i, j, best, numThreads = 0, pruned = 0;
+  int *positions = scanList;
+
+  if (scanList == NULL) {
+    positions = (int *) malloc(scanNum * sizeof(int));
+    if (positions == NULL) die("Could not init positions");
+    for (i=0; i < scanNum; i++) { positions[i] = i; }
+  }
+
+  // split positions between threads of each node
+  for (n=0; n < numNodes; n++) {
+    firstJob[n] = numThreads;
+    for (k=0; k < nodes[n].numThreads; k++, numThreads++) {
+      jobs[numThreads].node = &nodes[n];
+      jobs[numThreads].scanList = positions + (int)((int64_t)scanNum * k / nodes[n].numThreads);
+      jobs[numThreads].scanNum = (int)((int64_t)scanNum * (k + 1) / nodes[n].numThreads)
+                               - (int)((int64_t)scanNum * k / nodes[n].numThreads);
+      jobs[numThreads].positions = positions;
+      jobs[numThreads].numPositions = scanNum;
+      jobs[numThreads].tileImg = tileImg;
+      jobs[numThreads].tileRows = tileRows;
+      jobs[numThreads].hdr = hdr;
+      jobs[numThreads].chunks = chunks;
+      jobs[numThreads].showProgress = (numThreads == 0);
+      jobs[numThreads].pruned = 0;
+    }
+  }
+
+  // copy master tiles to each node
+  for (n=0; n < numNodes; n++) {
+    if (!nodes[n].copyFlag) continue;
+    if (pthread_create(&threads[n], NULL, prepareNode, &jobs[firstJob[n]]) != 0) die("Cannot create thread!");
+  }
+  for (n=0; n < numNodes; n++) {
+    if (nodes[n].copyFlag) pthread_join(threads[n], NULL);
+  }
+
+  // scan
+  for (t=0; t < numThreads; t++) {
+    if (pthread_create(&threads[t], NULL, scanThread, &jobs[t]) != 0) die("Cannot create thread!");
+  }
+  for (t=0; t < numThreads; t++) {
+    pthread_join(threads[t], NULL);
+    pruned += jobs[t].pruned;
+  }
+
+  // merge candidates of nodes
+  if (nodes[0].copyFlag) {
+    for (k=0; k < scanNum; k++) {
+      i = positions[k];
+      for (n=0; n < numNodes; n++) { next[n] = 0; }
+      for (j=0; j < tileRows[i]; j++) {
+        best = 0;
+        for (n=1; n < numNodes; n++) {
+          if (nodes[n].tileScores[i][next[n]].score < nodes[best].tileScores[i][next[best]].score) best = n;
+        }
+        tileScores[i][j] = nodes[best].tileScores[i][next[best]++];
+      }
+    }
+  }
+
+  if (scanList == NULL) free(positions);
+  return pruned;
+}
+
+//-----------------------------------------------------------------------------
+// Sets up nodes for threads (-t) and NUMA (-n) options.
+// Returns: number of nodes.
+
+int initNodes(NumaNode *nodes, TileRecord *libDB, int numLibTiles, int *selList, int selNum,
+              TileRecord *tileImg, TileScore **tileScores, int numTiles)
+{
+  pthread_t threads[NODES_MAX];
+  int n, numNodes = 1;
+
+  if (opt_numa_flag) {
+    numNodes = numaNodes(nodes, NODES_MAX);
+    for (n=0; n < numNodes; n++) {
+      fprintf(stderr, "  node%d: %d cpus\n", nodes[n].id, CPU_COUNT(&nodes[n].cpus));
+    }
+    if (numNodes > opt_threads) numNodes = opt_threads;
+  }
+  else {
+    memset(&nodes[0], 0, sizeof(NumaNode));
+  }
+
+  for (n=0; n < numNodes; n++) {
+    nodes[n].numThreads = opt_threads / numNodes + (n < opt_threads % numNodes);
+    nodes[n].pinFlag = (numNodes > 1);
+    nodes[n].copyFlag = (numNodes > 1);
+    nodes[n].numTiles = numTiles;
+    if (!nodes[n].copyFlag) {
+      // single node uses tiles of main thread
+      nodes[n].tileImg = tileImg;
+      nodes[n].tileScores = tileScores;
+    }
+  }
+  fprintf(stderr, "  threads:%d  nodes:%d\n", opt_threads, numNodes);
+
+  // copy each node's share of tile database into its memory
+  splitLibrary(nodes, numNodes, libDB, numLibTiles, selList, selNum);
+  for (n=0; n < numNodes; n++) {
+    if (!nodes[n].copyFlag) continue;
+    if (pthread_create(&threads[n], NULL, copyNodeLibrary, &nodes[n]) != 0) die("Cannot create thread!");
+  }
+  for (n=0; n < numNodes; n++) {
+    if (nodes[n].copyFlag) pthread_join(threads[n], NULL);
+  }
+  return numNodes;
+}
+
+//-----------------------------------------------------------------------------
+// Scores the listed tile positions (or first scanNum if NULL), using threads if given.
+// Returns: number of chunks skipped.
+
+int scanTiles(NumaNode *nodes, int numNodes, TileRecord *libDB, int numLibTiles, int *selList, int selNum,
+              TileRecord *tileImg, TileScore **tileScores, int *tileRows, int *scanList, int scanNum,
+              MosaicHeader *hdr, LibraryChunks *chunks)
+{
+  if (chunks) chunkTileSums(chunks, tileImg, scanList, scanNum, hdr);
+  if (opt_threads > 1) {
+    return scanThreaded(nodes, numNodes, tileImg, tileScores, tileRows, scanList, scanNum, hdr, chunks);
+  }
+  return scanLibrary(libDB, 0, numLibTiles, selList, selNum, tileImg, tileScores, tileRows,
+                     scanList, scanNum, hdr, chunks, TRUE);
+}
+
+void freeNodes(NumaNode *nodes, int numNodes, int numTiles)
+{
+  int n, i;
+  for (n=0; n < numNodes; n++) {
+    if (!nodes[n].copyFlag) continue;
+    free(nodes[n].libDB);
+    free(nodes[n].selList);
+    free(nodes[n].tileImg);
+    if (nodes[n].tileScores) {
+      for (i=0; i < numTiles; i++) { free(nodes[n].tileScores[i]); }
+      free(nodes[n].tileScores);
+    }
+  }
+}
+
+// Frees candidates of listed tile positions in nodes with their own copies.
+
+void freeNodeRows(NumaNode *nodes, int numNodes, int *positions, int num)
+{
+  int n, k;
+  for (n=0; n < numNodes; n++) {
+    if (!nodes[n].copyFlag || nodes[n].tileScores == NULL) continue;
+    for (k=0; k < num; k++) {
+      free(nodes[n].tileScores[positions[k]]);
+      nodes[n].tileScores[positions[k]] = NULL;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Maps the entire tile database into memory (read-only).
+// Returns: pointer to first TileRecord, and number of records in numLibTiles.
+
+TileRecord *openLibrary(const char *dbFile, int *numLibTiles)
+{
+  int fd;
+  void *map;
+  struct stat statBuf;
+
+  fprintf(stderr, "Reading tile database file: %s \n", dbFile);
+
+  // get file size of tile database
+  if ((fd = open(dbFile, O_RDONLY)) < 0) die("Cannot open tile database file!");
+  if (fstat(fd, &statBuf) != 0) die("Cannot stat tile database file!");
+  *numLibTiles = statBuf.st_size / sizeof(TileRecord);
+  fprintf(stderr, "  size:%lld  numTiles:%d\n", (long long)statBuf.st_size, *numLibTiles);
+  if (statBuf.st_size < sizeof(TileRecord)) die("Tile database doesn't exist or zero size!");
+
+  map = mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) die("Cannot map tile database file!");
+  madvise(map, statBuf.st_size, MADV_SEQUENTIAL);
+  close(fd);  // mapping stays valid
+
+  return (TileRecord *) map;
+}
+
+void closeLibrary(TileRecord *libDB, int numLibTiles)
+{
+  if (munmap(libDB, (size_t)numLibTiles * sizeof(TileRecord)) != 0) die("Cannot unmap tile database file!");
+}
+
+//-----------------------------------------------------------------------------
+// Maps chunk summary of tile database made by sortdb (see sortdb.c).
+// Records added to the tile database since it was sorted are never skipped.
+// Bounds are sums over all BLOCKS, so the master must use the full block grid.
+
+LibraryChunks *openChunks(const char *chunksFile, const char *dbFile, TileRecord *libDB, int numLibTiles,
+                          int numTiles, int numBlocks)
+{
+  int fd, s;
+  void *map;
+  struct stat statBuf, dbStat;
+  LibraryChunks *chunks;
+  ChunkHeader *header;
+
+  if (numBlocks != BLOCKS) die("Option -p needs a master of 8x8 blocks per tile.");
+  fprintf(stderr, "Reading chunk summary: %s \n", chunksFile);
+  if ((fd = open(chunksFile, O_RDONLY)) < 0) die("Cannot open chunk summary file! Run sortdb first.");
+  if (fstat(fd, &statBuf) != 0) die("Cannot stat chunk summary file!");
+  if (statBuf.st_size < sizeof(ChunkHeader)) die("Chunk summary file is too small!");
+  map = mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) die("Cannot map chunk summary file!");
+  close(fd);
+
+  header = (ChunkHeader *) map;
+  if (header->magic != CHUNK_MAGIC) die("Chunk summary magic number invalid.");
+  if (header->chunkSize < 1 || statBuf.st_size != sizeof(ChunkHeader) + (off_t)header->numChunks * sizeof(ChunkBounds) ||
+      (int64_t)header->numChunks * header->chunkSize < header->numRecords) {
+    die("Chunk summary file is wrong size!");
+  }
+  // same checks as tile index (see selectRecords), since stale bounds would skip better tiles
+  if (stat(dbFile, &dbStat) != 0) die("Cannot stat tile database file!");
+  if (header->numRecords < 1 || header->numRecords > numLibTiles || libDB[0].imageID != header->firstID ||
+      libDB[header->numRecords - 1].imageID != header->lastID || dbStat.st_size < header->dbSize ||
+      (dbStat.st_size == header->dbSize && dbStat.st_mtime != header->dbTime)) {
+    die("Chunk summary doesn't match tile database. Run sortdb again.");
+  }
+  for (s=0; s < INDEX_SAMPLES; s++) {
+    if (libDB[indexSample(header->numRecords, s)].imageID != header->sampleID[s]) {
+      die("Chunk summary doesn't match tile database. Run sortdb again.");
+    }
+  }
+  fprintf(stderr, "  chunks:%d  chunk size:%d  (not summarized:%d)\n", header->numChunks, header->chunkSize,
+          numLibTiles - header->numRecords);
+
+  chunks = (LibraryChunks *) calloc(1, sizeof(LibraryChunks));
+  if (chunks == NULL) die("Could not init chunks");
+  chunks->header = header;
+  chunks->bounds = (ChunkBounds *)(header + 1);
+  chunks->mapSize = statBuf.st_size;
+  chunks->tileSums = malloc(numTiles * sizeof(*chunks->tileSums));
+  if (chunks->tileSums == NULL) die("Could not init tileSums");
+  return chunks;
+}
+
+void closeChunks(LibraryChunks *chunks)
+{
+  munmap(chunks->header, chunks->mapSize);
+  free(chunks->tileSums);
+  free(chunks);
+}
+
+//-----------------------------------------------------------------------------
+// Parses filter expression into list of ranges on index columns.
+// Returns: number of ranges.
+
+/*
+  Filter expression is a comma separated list of:  name=min:max
+    where name is one of:
+      aspect = xres/yres of original image (e.g. aspect=0.616:0.716)
+      ydelta = tile brightness, Ydelta [-255,+255]
+      u, v   = mean U or V color of tile [0,255]
+      id     = imageID
+    min or max can be left out (e.g. u=140: ), or use name=value for one value.
+*/
+
+int parseFilter(const char *expr, int *predCol, int32_t *predMin, int32_t *predMax, int maxPreds)
+{
+  static const char *names[INDEX_COLUMNS] = { "aspect", "ydelta", "u", "v", "id" };
+  char *buf, *item, *val, *colon, *save = NULL;
+  int c, numPreds = 0;
+  double f;
+
+  buf = strdup(expr);
+  for (item = strtok_r(buf, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+    if ((val = strchr(item, '=')) == NULL) die("Filter missing '=' (e.g. ydelta=-20:20)");
+    *val++ = '\0';
+    for (c=0; c < INDEX_COLUMNS && strcmp(item, names[c]) != 0; c++) ;
+    if (c == INDEX_COLUMNS) die("Filter name must be one of: aspect, ydelta, u, v, id");
+    if (numPreds == maxPreds) die("Too many filter ranges!");
+
+    predCol[numPreds] = c;
+    predMin[numPreds] = INT32_MIN;
+    predMax[numPreds] = INT32_MAX;
+    if ((colon = strchr(val, ':')) != NULL) { *colon++ = '\0'; }
+    else { colon = val; }  // single value
+
+    // aspect is stored * 1000 in index, rounded the same as by mkindex
+    if (*val != '\0') {
+      if (sscanf(val, "%lf", &f) != 1) die("Filter has invalid min value!");
+      predMin[numPreds] = (c == INDEX_ASPECT) ? aspectValue(f) : (int32_t)f;
+    }
+    if (*colon != '\0') {
+      if (sscanf(colon, "%lf", &f) != 1) die("Filter has invalid max value!");
+      predMax[numPreds] = (c == INDEX_ASPECT) ? aspectValue(f) : (int32_t)f;
+    }
+    numPreds++;
+  }
+  free(buf);
+  return numPreds;
+}
+
+//-----------------------------------------------------------------------------
+// Returns first entry in sorted column with value >= min, or value > max
+// when upper is set.
+
+int searchColumn(IndexEntry *column, int num, int32_t value, int upper)
+{
+  int lo = 0, hi = num, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (column[mid].value < value || (upper && column[mid].value == value)) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+//-----------------------------------------------------------------------------
+// Selects records in tile database matching filter expression, using the
+// sidecar attribute index (see mkindex.c), without reading the records.
+// Records added to the tile database since it was indexed are checked directly.
+// Returns: selection vector of record numbers in database order.
+
+int *selectRecords(TileRecord *libDB, int numLibTiles, const char *dbFile, const char *indexFile, 
+                   const char *expr, int *selNum)
+{
+  int predCol[16];
+  int32_t predMin[16], predMax[16], attrs[INDEX_COLUMNS];
+  int fd, p, k, lo, hi, r, s, numPreds, numRecords;
+  int *selList;
+  uint8_t *counts;
+  void *map;
+  struct stat statBuf, dbStat;
+  IndexHeader *header;
+  IndexEntry *column;
+
+  numPreds = parseFilter(expr, predCol, predMin, predMax, 16);
+  fprintf(stderr, "Reading tile index: %s \n", indexFile);
+
+  // map index file
+  if ((fd = open(indexFile, O_RDONLY)) < 0) die("Cannot open tile index file! Run mkindex first.");
+  if (fstat(fd, &statBuf) != 0) die("Cannot stat tile index file!");
+  if (statBuf.st_size < sizeof(IndexHeader)) die("Tile index file is too small!");
+  map = mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) die("Cannot map tile index file!");
+  close(fd);
+
+  header = (IndexHeader *) map;
+  numRecords = header->numRecords;
+  if (header->magic != INDEX_MAGIC) die("Tile index magic number invalid.");
+  if (statBuf.st_size != sizeof(IndexHeader) + (off_t)INDEX_COLUMNS * numRecords * sizeof(IndexEntry)) {
+    die("Tile index file is wrong size!");
+  }
+  // indexed records must be unchanged: same file if not appended to since, and sampled ids match
+  if (stat(dbFile, &dbStat) != 0) die("Cannot stat tile database file!");
+  if (numRecords < 1 || numRecords > numLibTiles || libDB[0].imageID != header->firstID ||
+      libDB[numRecords - 1].imageID != header->lastID || dbStat.st_size < header->dbSize ||
+      (dbStat.st_size == header->dbSize && dbStat.st_mtime != header->dbTime)) {
+    die("Tile index doesn't match tile database. Run mkindex again.");
+  }
+  for (s=0; s < INDEX_SAMPLES; s++) {
+    if (libDB[indexSample(numRecords, s)].imageID != header->sampleID[s]) {
+      die("Tile index doesn't match tile database. Run mkindex again.");
+    }
+  }
+
+  // count how many ranges each indexed record falls in
+  counts = (uint8_t *) calloc(numRecords, sizeof(uint8_t));
+  selList = (int *) malloc(numLibTiles * sizeof(int));
+  if (counts == NULL || selList == NULL) die("Could not init selection vector");
+  for (p=0; p < numPreds; p++) {
+    column = (IndexEntry *)(header + 1) + (size_t)predCol[p] * numRecords;
+    lo = searchColumn(column, numRecords, predMin[p], 0);
+    hi = searchColumn(column, numRecords, predMax[p], 1);
+    for (k=lo; k < hi; k++) { counts[column[k].record]++; }
+  }
+
+  *selNum = 0;
+  for (r=0; r < numRecords; r++) {
+    if (counts[r] == numPreds) selList[(*selNum)++] = r;
+  }
+
+  // records not in index yet
+  for (r=numRecords; r < numLibTiles; r++) {
+    tileAttributes(&libDB[r], attrs);
+    for (p=0; p < numPreds; p++) {
+      if (attrs[predCol[p]] < predMin[p] || attrs[predCol[p]] > predMax[p]) break;
+    }
+    if (p == numPreds) selList[(*selNum)++] = r;
+  }
+
+  fprintf(stderr, "  filter: %s  selected:%d of %d  (not indexed:%d)\n", expr, *selNum, numLibTiles,
+          numLibTiles - numRecords);
+  if (*selNum == 0) die("Filter matches no tiles!");
+
+  munmap(map, statBuf.st_size);
+  free(counts);
+  return selList;
+}
+
+//-----------------------------------------------------------------------------
+// Removes excluded tiles (-e) from selection vector, so they're never scored.
+// Returns: new selection vector, or selList if nothing removed.
+
+int *excludeRecords(TileRecord *libDB, int numLibTiles, int *selList, int *selNum)
+{
+  int i, n, num;
+  int *newList;
+  Pvoid_t idList = usedTiles();
+  Word_t value, *pvalue;
+
+  if (selList == NULL) *selNum = numLibTiles;
+  newList = (int *) malloc(*selNum * sizeof(int));
+  if (newList == NULL) die("Could not init selection vector");
+
+  for (n=0, num=0; n < *selNum; n++) {
+    i = (selList) ? selList[n] : n;
+    JLG(pvalue, idList, (Word_t) abs(libDB[i].imageID));  // JudyLGet()
+    if (pvalue == NULL || *pvalue != EXCLUDED) newList[num++] = i;  // keep locked tiles
+  }
+  JLFA(value, idList);  // JudyLFreeArray()
+
+  fprintf(stderr, "  excluded:%d tiles\n", *selNum - num);
+  if (num == 0) die("Every tile is excluded!");
+  *selNum = num;
+  free(selList);
+  return newList;
+}
+
+//-----------------------------------------------------------------------------
+// Fills in tile database fingerprint of cache header, used to tell if the
+// tile database has changed since the cache was saved.
+
+void libraryFingerprint(const char *dbFile, TileRecord *libDB, int numLibTiles, CacheHeader *cache)
+{
+  struct stat statBuf;
+
+  if (stat(dbFile, &statBuf) != 0) die("Cannot stat tile database file!");
+  cache->numLibTiles = numLibTiles;
+  cache->firstID = libDB[0].imageID;
+  cache->lastID = libDB[numLibTiles - 1].imageID;
+  cache->dbSize = statBuf.st_size;
+  cache->dbTime = statBuf.st_mtime;
+}
+
+//-----------------------------------------------------------------------------
+// Saves candidate lists (tileScores) of every tile position to cache file.
+
+/*
+  Cache file format:  (see mosaic.h)
+    CacheHeader
+    CacheEntry, TileScore[num]   for each tile position in order
+*/
+
+// Fills in cache header for master image and tile database.
+
+void initCache(CacheHeader *cache, MosaicHeader *hdr, int numTiles,
+               const char *dbFile, TileRecord *libDB, int numLibTiles)
+{
+  memset(cache, 0, sizeof(CacheHeader));
+  cache->magic = CACHE_MAGIC;
+  cache->numTiles = numTiles;
+  cache->topK = opt_topk;
+  cache->hdr = *hdr;
+  libraryFingerprint(dbFile, libDB, numLibTiles, cache);
+}
+
+// Writes candidate lists of tile positions first to last-1.
+
+void writeCacheEntries(FILE *CACHE, TileScore **tileScores, int *tileRows, TileRecord *tileImg,
+                       int first, int last)
+{
+  int i;
+  CacheEntry entry;
+
+  for (i=first; i < last; i++) {
+    entry.pos = tileImg[i].imageID;
+    entry.Ydelta = tileImg[i].Ydelta;
+    entry.num = (tileRows[i] < i + opt_locked_num + 1) ? tileRows[i] : i + opt_locked_num + 1;  // grouped rows may be longer
+    if (fwrite(&entry, sizeof(CacheEntry), 1, CACHE) != 1) die("Problem writing cache!");
+    if (fwrite(tileScores[i], sizeof(TileScore), entry.num, CACHE) != entry.num) die("Problem writing cache!");
+  }
+}
+
+void saveCache(const char *cacheFile, MosaicHeader *hdr, int numTiles, TileScore **tileScores, int *tileRows,
+               TileRecord *tileImg, const char *dbFile, TileRecord *libDB, int numLibTiles)
+{
+  FILE *CACHE;
+  CacheHeader cache;
+
+  fprintf(stderr, "Saving candidate cache: %s \n", cacheFile);
+  initCache(&cache, hdr, numTiles, dbFile, libDB, numLibTiles);
+
+  if ((CACHE = fopen(cacheFile, "wb")) == NULL) die("Cannot open cache file!");
+  if (fwrite(&cache, sizeof(CacheHeader), 1, CACHE) != 1) die("Problem writing cache!");
+  writeCacheEntries(CACHE, tileScores, tileRows, tileImg, 0, cache.numTiles);
+  if (fclose(CACHE) != 0) die("Cannot close cache file!");
+}
+
+//-----------------------------------------------------------------------------
+// Memory budget (-m): scores tile positions in passes over the tile database,
+// keeping candidates of only one pass in memory, and spilling them to a file
+// in cache format (the cache file itself if -c given). Each pass takes the next
+// tile positions in order until their candidates fill the budget left after
+// the master tiles, so later passes have fewer positions.
+// Returns: spill file, positioned after cache header, to be read by
+// writeCacheTiles().
+
+int passEnd(int *tileRows, int numTiles, int first, int64_t budget)
+{
+  int64_t used = 0;
+  int last = first;
+
+  do {
+    used += tileRows[last++] * sizeof(TileScore);
+  } while (last < numTiles && used + tileRows[last] * sizeof(TileScore) <= budget);
+  return last;
+}
+
+FILE *scanInPasses(NumaNode *nodes, int numNodes, TileRecord *libDB, int numLibTiles, int *selList, int selNum,
+                   TileRecord *tileImg, TileScore **tileScores, int *tileRows, int numTiles, MosaicHeader *hdr,
+                   LibraryChunks *chunks, CacheHeader *cache, int *pruned)
+{
+  int i, fd, first, last, pass, numPasses = 0;
+  int *positions;
+  int64_t budget;
+  char spillFile[1024];
+  const char *tmpDir;
+  FILE *SPILL;
+
+  // leave room for memory used by every pass
+  budget = (int64_t)opt_mem_budget * 1024 * 1024
+         - (int64_t)numTiles * (sizeof(TileRecord) + sizeof(TileScore *) + 2 * sizeof(int));
+  if (chunks) budget -= (int64_t)numTiles * SUMS * sizeof(int32_t);
+  if (selList) budget -= (int64_t)selNum * sizeof(int);
+  if (numNodes > 1) {
+    // nodes have their own copies of tile database, master tiles and candidates
+    budget -= (int64_t)numNodes * numTiles * (sizeof(TileRecord) + sizeof(TileScore *))
+            + (int64_t)numLibTiles * sizeof(TileRecord);
+    budget /= numNodes + 1;
+  }
+  if (budget <= 0) die("Memory budget is too small for master image!");
+  for (first=0; first < numTiles; first = passEnd(tileRows, numTiles, first, budget)) { numPasses++; }
+  fprintf(stderr, "  memory budget:%d MB  passes:%d\n", opt_mem_budget, numPasses);
+
+  if (opt_cachefile) {
+    fprintf(stderr, "Saving candidate cache: %s \n", opt_cachefile);
+    if ((SPILL = fopen(opt_cachefile, "w+b")) == NULL) die("Cannot open cache file!");
+  }
+  else {
+    tmpDir = getenv("TMPDIR");
+    snprintf(spillFile, sizeof(spillFile), "%s/mosaic_XXXXXX", (tmpDir && *tmpDir) ? tmpDir : "/tmp");
+    if ((fd = mkstemp(spillFile)) < 0 || (SPILL = fdopen(fd, "w+b")) == NULL) die("Cannot create spill file!");
+    unlink(spillFile);  // removed when closed
+  }
+  initCache(cache, hdr, numTiles, opt_dbfile, libDB, numLibTiles);
+  if (fwrite(cache, sizeof(CacheHeader), 1, SPILL) != 1) die("Problem writing cache!");
+
+  positions = (int *) malloc(numTiles * sizeof(int));
+  if (positions == NULL) die("Could not init positions");
+  *pruned = 0;
+
+  for (pass=1, first=0; first < numTiles; pass++, first = last) {
+    last = passEnd(tileRows, numTiles, first, budget);
+    fprintf(stderr, "Pass %d of %d: tile positions %d to %d\n", pass, numPasses, first, last - 1);
+    for (i=first; i < last; i++) {
+      tileScores[i] = (TileScore *) malloc(tileRows[i] * sizeof(TileScore));
+      if (tileScores[i] == NULL) die("Could not init tileScores[i]");
+      resetScores(tileScores[i], tileRows[i]);
+      positions[i - first] = i;
+    }
+    *pruned += scanTiles(nodes, numNodes, libDB, numLibTiles, selList, selNum, tileImg, tileScores, tileRows,
+                         positions, last - first, hdr, chunks);
+    fprintf(stderr, "\n");
+
+    writeCacheEntries(SPILL, tileScores, tileRows, tileImg, first, last);
+    for (i=first; i < last; i++) {
+      free(tileScores[i]);
+      tileScores[i] = NULL;
+    }
+    freeNodeRows(nodes, numNodes, positions, last - first);
+  }
+  free(positions);
+
+  if (fflush(SPILL) != 0) die("Problem writing cache!");
+  if (fseek(SPILL, sizeof(CacheHeader), SEEK_SET) != 0) die("Cannot read back cache!");
+  return SPILL;
+}
+
+//-----------------------------------------------------------------------------
+// Writes tiles of mosaic CSV from candidate lists read from cache file, one
+// tile position at a time, the same as writeTiles().
+
+void writeCacheTiles(FILE *CACHE, CacheHeader *cache, FILE *outfile)
+{
+  int i, k, num, maxRow = 0, numShort = 0, allFlag, next = 0;
+  int32_t ids[3];
+  CacheEntry entry;
+  TileScore *row = NULL;
+  Pvoid_t idList;    // JudyL array (Judy.h required)
+  Word_t  value;
+
+  allFlag = (cache->numTiles + opt_locked_num == cache->hdr.dups && opt_exclude_num == 0);
+  idList = usedTiles();
+
+  for (i=0; i < cache->numTiles; i++) {
+    k = i + opt_locked_num;  // number of tiles placed before this one
+    if (fread(&entry, sizeof(CacheEntry), 1, CACHE) != 1) die("Cache file is truncated!");
+    if (entry.num < 1 || entry.num > k + 1) die("Cache file is corrupt!");
+    if (entry.num > maxRow) {
+      maxRow = entry.num;
+      row = (TileScore *) realloc(row, maxRow * sizeof(TileScore));
+      if (row == NULL) die("Could not allocate cache row");
+    }
+    if (fread(row, sizeof(TileScore), entry.num, CACHE) != entry.num) die("Cache file is truncated!");
+    if (entry.num < k / cache->hdr.dups + 1) numShort++;
+
+    num = candidatesUsed(entry.num, k, cache->hdr.dups);
+    if (allFlag) {
+      ids[0] = candidateID(row, num, 0);
+      ids[1] = (k >= 1) ? candidateID(row, num, 1) : -1;
+      ids[2] = (k >= 2) ? candidateID(row, num, 2) : -1;
+    }
+    else {
+      assignTile(&idList, row, num, k, cache->hdr.dups, ids);
+    }
+    writeLockedTiles(outfile, &next, entry.pos);
+    fprintf(outfile, "%d,%d,%d,%d,%d\n", entry.pos, entry.Ydelta, ids[0], ids[1], ids[2]);
+  }
+  writeLockedTiles(outfile, &next, INT_MAX);
+  if (numShort > 0) {
+    fprintf(stderr, "Warning: %d tile positions have fewer candidates than dups needs.\n"
+            "  Save cache with larger -k to use a smaller dups.\n", numShort);
+  }
+
+  JLFA(value, idList);  // JudyLFreeArray()
+  free(row);
+}
+
+//-----------------------------------------------------------------------------
+// Writes mosaic CSV from cache file alone. Uses dups from -u if given.
+// If the tile database is given, checks that it hasn't changed.
+
+void replayCache(const char *cacheFile, FILE *outfile, const char *dbFile)
+{
+  FILE *CACHE;
+  CacheHeader cache, current;
+  TileRecord *libDB;
+  int numLibTiles;
+
+  fprintf(stderr, "Reading candidate cache: %s \n", cacheFile);
+  if ((CACHE = fopen(cacheFile, "rb")) == NULL) die("Cannot open cache file!");
+  if (fread(&cache, sizeof(CacheHeader), 1, CACHE) != 1) die("Cache file is too small!");
+  if (cache.magic != CACHE_MAGIC) die("Cache magic number invalid.");
+  fprintf(stderr, "  tiles:%d  topK:%d  dups:%d  tile database:%d tiles\n", cache.numTiles, cache.topK,
+          cache.hdr.dups, cache.numLibTiles);
+
+  if (dbFile) {
+    libDB = openLibrary(dbFile, &numLibTiles);
+    memset(&current, 0, sizeof(CacheHeader));
+    libraryFingerprint(dbFile, libDB, numLibTiles, &current);
+    closeLibrary(libDB, numLibTiles);
+    if (current.numLibTiles != cache.numLibTiles || current.firstID != cache.firstID ||
+        current.lastID != cache.lastID || current.dbSize != cache.dbSize || current.dbTime != cache.dbTime) {
+      die("Tile database has changed since cache was saved. Run mosaic again without -r.");
+    }
+  }
+
+  if (opt_dups > 0) cache.hdr.dups = opt_dups;
+  writeHeader(outfile, &cache.hdr);
+  writeCacheTiles(CACHE, &cache, outfile);
+  fclose(CACHE);
+}
+
+//-----------------------------------------------------------------------------
+// Returns TRUE if frames pattern has exactly one integer conversion for the
+// frame number (e.g. "mosaic_%06d.csv"), and no other conversions but "%%".
+
+int validFramePattern(const char *pattern)
+{
+  const char *p;
+  int num = 0;
+
+  for (p = strchr(pattern, '%'); p != NULL; p = strchr(p, '%')) {
+    p++;
+    if (*p == '%') { p++; continue; }
+    p += strspn(p, "-+ 0#");    // flags
+    p += strspn(p, "0123456789");  // width
+    if (*p != 'd' && *p != 'i' && *p != 'u' && *p != 'x' && *p != 'X' && *p != 'o') return FALSE;
+    num++;
+  }
+  return (num == 1);
+}
+
+//-----------------------------------------------------------------------------
+// Opens the output for a frame. Without a frames pattern, every frame goes to
+// stdout one after another.
+
+FILE *openFrameOutput(int frame)
+{
+  char filename[1024];
+  FILE *out;
+
+  if (opt_frames_out == NULL) return stdout;
+  snprintf(filename, sizeof(filename), opt_frames_out, frame);
+  if ((out = fopen(filename, "w")) == NULL) die("Cannot open frame output file!");
+  return out;
+}
+
+void closeFrameOutput(FILE *out)
+{
+  if (out == stdout) { fflush(out); return; }
+  if (fclose(out) != 0) die("Cannot close frame output file!");
+}
+
+//-----------------------------------------------------------------------------
+
+int usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [options] tile_bin.db < input.csv > output.csv \n", progname);
+  fprintf(stderr, "       %s -r <cache_file> [options] [tile_bin.db] > output.csv \n", progname);
+  fprintf(stderr, "Options:\n"
+    "\t-s, --sequence <score>   : Read a stream of master frames, re-scoring only tile positions\n"
+    "\t                           that changed by more than <score> since they were last scored.\n"
+    "\t-o, --frames-out <file>  : In sequence mode, write each frame to a file, where <file> is a\n"
+    "\t                           printf pattern for the frame number. (e.g. mosaic_%%06d.csv)\n"
+    "\t                           Default is to write all frames to stdout.\n"
+    "\t-f, --filter <expr>      : Use only tiles matching filter, using tile index from mkindex.\n"
+    "\t                           <expr> is comma separated list of name=min:max, where name is\n"
+    "\t                           aspect, ydelta, u, v or id. (e.g. aspect=0.616:0.716,ydelta=-40:40)\n"
+    "\t-x, --index <file>       : Tile index file. (default=tile_bin.idx)\n"
+    "\t-c, --cache <file>       : Save candidate tiles of every position to cache file.\n"
+    "\t-k, --topk <num>         : Keep at least <num> candidates per position. (default=as needed by dups)\n"
+    "\t-r, --replay <file>      : Write mosaic from cache file, without scanning tile database.\n"
+    "\t                           If tile_bin.db is given, checks that it hasn't changed.\n"
+    "\t-u, --dups <num>         : With -r, use different number of duplicate tiles.\n"
+    "\t-e, --exclude <ids>      : Never use these tiles. Comma separated list of image ids.\n"
+    "\t-p, --prune              : Skip chunks of tiles that can't match, using chunk summary from\n"
+    "\t                           sortdb (tile_bin.chunks).\n"
+    "\t-g, --group <score>      : Score tile positions within <score> of each other only once.\n"
+    "\t                           Use 0 to group only positions that are the same.\n"
+    "\t-t, --threads <num>      : Number of threads. (default=1)\n"
+    "\t-n, --numa               : Split tile database between memory nodes (CPU sockets), each\n"
+    "\t                           with its own copy in its own memory. (needs -t)\n"
+    "\t-m, --mem-budget <MB>    : Keep memory used for candidate tiles within <MB>, scanning the\n"
+    "\t                           tile database in more than one pass if needed.\n"
+    "\t-l, --locked <file>      : Keep tiles of previous mosaic CSV at positions not listed in input,\n"
+    "\t                           counting them against dups. Input may list only some positions.\n"
+    "\n"
+  );
+  return 1;
+}
+
+int cmdLine(int argc, char *argv[])
+{
+  static struct option longOpts[] = {
+    { "sequence",   required_argument, NULL, 's' },
+    { "frames-out", required_argument, NULL, 'o' },
+    { "filter",     required_argument, NULL, 'f' },
+    { "index",      required_argument, NULL, 'x' },
+    { "cache",      required_argument, NULL, 'c' },
+    { "topk",       required_argument, NULL, 'k' },
+    { "replay",     required_argument, NULL, 'r' },
+    { "dups",       required_argument, NULL, 'u' },
+    { "exclude",    required_argument, NULL, 'e' },
+    { "prune",      no_argument,       NULL, 'p' },
+    { "group",      required_argument, NULL, 'g' },
+    { "threads",    required_argument, NULL, 't' },
+    { "numa",       no_argument,       NULL, 'n' },
+    { "mem-budget", required_argument, NULL, 'm' },
+    { "locked",     required_argument, NULL, 'l' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt, id;
+  char *item, *save = NULL;
+
+  while ((opt = getopt_long(argc, argv, "?s:o:f:x:c:k:r:u:e:pg:t:nm:l:", longOpts, NULL)) != -1) {
+    switch (opt) {
+      case 's':  // sequence mode
+        opt_seq_flag = TRUE;
+        if (sscanf(optarg, "%d", &opt_seq_score) != 1 || opt_seq_score < 0) {
+          fprintf(stderr, "Invalid sequence score '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'o':  // frame output pattern
+        if (!validFramePattern(optarg)) {
+          fprintf(stderr, "Frames pattern '%s' must have one %%d for the frame number\n", optarg);
+          return usage(argv[0]);
+        }
+        opt_frames_out = strdup(optarg);
+        break;
+      case 'f':  // filter expression
+        opt_filter = strdup(optarg);
+        break;
+      case 'x':  // tile index filename
+        opt_indexfile = strdup(optarg);
+        break;
+      case 'c':  // save cache filename
+        opt_cachefile = strdup(optarg);
+        break;
+      case 'k':  // candidates to keep
+        if (sscanf(optarg, "%d", &opt_topk) != 1 || opt_topk < 1) {
+          fprintf(stderr, "Invalid topk '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'r':  // replay cache filename
+        opt_replayfile = strdup(optarg);
+        break;
+      case 'u':  // dups
+        if (sscanf(optarg, "%d", &opt_dups) != 1 || opt_dups < 1) {
+          fprintf(stderr, "Invalid dups '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'e':  // excluded tile ids
+        for (item = strtok_r(optarg, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+          if (sscanf(item, "%d", &id) != 1) {
+            fprintf(stderr, "Invalid tile id '%s'\n", item);
+            return usage(argv[0]);
+          }
+          opt_exclude = (int32_t *) realloc(opt_exclude, (opt_exclude_num + 1) * sizeof(int32_t));
+          if (opt_exclude == NULL) die("Could not allocate exclude list");
+          opt_exclude[opt_exclude_num++] = id;
+        }
+        save = NULL;
+        break;
+      case 'p':  // prune chunks
+        opt_prune_flag = TRUE;
+        break;
+      case 't':  // threads
+        if (sscanf(optarg, "%d", &opt_threads) != 1 || opt_threads < 1 || opt_threads > THREADS_MAX) {
+          fprintf(stderr, "Invalid number of threads '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'n':  // NUMA
+        opt_numa_flag = TRUE;
+        break;
+      case 'l':  // locked tiles filename
+        opt_lockedfile = strdup(optarg);
+        break;
+      case 'm':  // memory budget
+        if (sscanf(optarg, "%d", &opt_mem_budget) != 1 || opt_mem_budget < 1) {
+          fprintf(stderr, "Invalid memory budget '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      case 'g':  // group tolerance
+        if (sscanf(optarg, "%d", &opt_group) != 1 || opt_group < 0) {
+          fprintf(stderr, "Invalid group score '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+  if (opt_replayfile) {
+    // tile database is optional
+    if (optind < argc - 1) return usage(argv[0]);
+    if (optind == argc - 1) opt_dbfile = argv[optind];
+    if (opt_seq_flag || opt_cachefile || opt_mem_budget || opt_lockedfile) {
+      fprintf(stderr, "Can't use -r with -s, -c, -m or -l\n");
+      return usage(argv[0]);
+    }
+    return 0;
+  }
+  if (optind != argc - 1) return usage(argv[0]);
+  opt_dbfile = argv[optind];
+  if (opt_indexfile == NULL && (opt_indexfile = sidecarFilename(opt_dbfile, "idx")) == NULL) {
+    die("Could not allocate filename");
+  }
+  if (opt_dups > 0) {
+    fprintf(stderr, "Option -u is only used with -r\n");
+    return usage(argv[0]);
+  }
+  if (opt_seq_flag && (opt_cachefile || opt_group >= 0)) {
+    fprintf(stderr, "Can't use -c or -g with -s\n");
+    return usage(argv[0]);
+  }
+  if (opt_mem_budget && (opt_seq_flag || opt_group >= 0)) {
+    fprintf(stderr, "Can't use -s or -g with -m\n");
+    return usage(argv[0]);
+  }
+  if (opt_lockedfile && (opt_seq_flag || opt_cachefile)) {
+    fprintf(stderr, "Can't use -s or -c with -l\n");
+    return usage(argv[0]);
+  }
+  if (opt_numa_flag && opt_threads < 2) {
+    fprintf(stderr, "Option -n needs -t of 2 or more threads\n");
+    return usage(argv[0]);
+  }
+  return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -478,134 +2051,233 @@ void usage()
 int main(int argc, char * argv[])
 {
   // init variables
-  int numTiles = 600, Xtiles = 20, Ytiles = 30;
-  int numBlocks = 64, Xblocks = 8, Yblocks = 8;
-  int flags = 0, lumFlag = 0, vflipFlag = 0, Wy = 1, Wc = 1, We = 0, dups = 600;
-  int i, numLibTiles, dbSize;
+  int numTiles = 600, numBlocks = 64;
+  int lumFlag = 0, vflipFlag = 0;
+  int e, i, k, maxTiles, numLibTiles, numChanged, frame = 1;
+  int *changed = NULL;
+  int16_t *scoredYdelta = NULL;
+  int *selList = NULL, selNum = 0;
+  int *tileRows;
+  int *groupRep = NULL, *reps = NULL, numGroups = 0;
+  int numNodes = 0, pruned = 0;
+  NumaNode nodes[NODES_MAX];
+  char *chunksFile;
+  LibraryChunks *chunks = NULL;
   time_t timeBegin, timeEnd;
   clock_t clockBegin, clockEnd;
   double clockDiff;
-  FILE *DB;
+  FILE *OUTFILE, *SPILL = NULL;
+  CacheHeader spill;
+  MosaicHeader hdr, frameHdr;
   TileScore **tileScores;
-  TileRecord *tileImg;
-  TileRecord libImg;
+  TileRecord *tileImg, *frameImg = NULL;
+  TileRecord *libDB;
 
   // process command line
-  if (argc != 2) usage();
+  if ( (e = cmdLine(argc, argv)) ) { return e; }
   fprintf(stderr, "Running mosaic\n");  // ** DEBUG **
 
+  //--- Replay mode: write mosaic from cache file only ---
+  if (opt_replayfile) {
+    replayCache(opt_replayfile, stdout, opt_dbfile);
+    fprintf(stderr, "Done mosaic\n\n");
+    return 0;
+  }
+
   //--- Read master image tiles in CSV format from STDIN ---
   fprintf(stderr, "Reading master image in CSV format from STDIN...\n");  // ** DEBUG **
 
-  int temp = fscanf(stdin, " %d , %d , %d, %d , %d , %d , %d , %d , %d ", 
-                &Xtiles, &Ytiles, &Xblocks, &Yblocks, &flags, &Wy, &Wc, &We, &dups);
-  if (temp != 9) die("CSV first line missing values or incorrectly formatted!");
-  numTiles = Xtiles * Ytiles;  // assume all tiles present in input  TODO: can't really assume this!
-  numBlocks = Xblocks * Yblocks;
+  if (!readHeaderCSV(stdin, &hdr)) die("CSV first line missing values or incorrectly formatted!");
+  maxTiles = hdr.Xtiles * hdr.Ytiles;  // input may list fewer (see -l)
+  numBlocks = hdr.Xblocks * hdr.Yblocks;
 
   // set flags
-  lumFlag   = (flags & 0x01);         // 0x01
-  vflipFlag = (flags & 0x02) >> 1;    // 0x02
+  lumFlag   = (hdr.flags & 0x01);         // 0x01
+  vflipFlag = (hdr.flags & 0x02) >> 1;    // 0x02
 
   //--- Allocate memory for arrays (TODO: move this to initArrays() ) ---
-  tileImg = (TileRecord *) calloc(numTiles, sizeof(TileRecord));  // must use calloc
+  tileImg = (TileRecord *) calloc(maxTiles, sizeof(TileRecord));  // must use calloc
   if (tileImg == NULL) die("Could not init tileImg");
-  tileScores = (TileScore **) malloc(numTiles * sizeof(TileScore *));
+  tileScores = (TileScore **) calloc(maxTiles, sizeof(TileScore *));
   if (tileScores == NULL) die("Could not init tileScores");
+  tileRows = (int *) calloc(maxTiles, sizeof(int));  // no rows until tiles are read
+  if (tileRows == NULL) die("Could not init tileRows");
+  initArrays(maxTiles, numBlocks, tileImg, tileScores, tileRows);
+  numTiles = readTilesFromCSV(stdin, maxTiles, numBlocks, tileImg);
+  if (numTiles == 0) die("CSV input has no tiles!");
+  if (numTiles < maxTiles) {
+    // only -l re-scores part of a mosaic, otherwise input ended early
+    if (!opt_lockedfile) die("CSV input missing tiles! (only -l allows listing some tile positions)");
+    fprintf(stderr, "  input lists %d of %d tile positions\n", numTiles, maxTiles);
+    tileImg = (TileRecord *) realloc(tileImg, numTiles * sizeof(TileRecord));
+    tileScores = (TileScore **) realloc(tileScores, numTiles * sizeof(TileScore *));
+    tileRows = (int *) realloc(tileRows, numTiles * sizeof(int));
+    if (tileImg == NULL || tileScores == NULL || tileRows == NULL) die("Could not init tileImg");
+  }
+  if (opt_lockedfile) {
+    readLockedTiles(opt_lockedfile, &hdr, tileImg, numTiles);
+  }
+
   for (i=0; i < numTiles; i++) {
     // tileScores[i] = (TileScore *) malloc(numTiles * sizeof(TileScore));
-    tileScores[i] = (TileScore *) malloc((i+1) * sizeof(TileScore));  // half square
+    // tileScores[i] = (TileScore *) malloc((i+1) * sizeof(TileScore));  // half square
+    // only k / dups + 1 scores are ever used, where k is number of tiles placed
+    // before this one, including locked tiles, unless more are kept for cache (-k)
+    k = i + opt_locked_num;
+    tileRows[i] = k / hdr.dups + 1;
+    if (tileRows[i] < opt_topk) { tileRows[i] = (opt_topk < k + 1) ? opt_topk : k + 1; }
+    if (opt_mem_budget) continue;  // allocated for each pass
+    tileScores[i] = (TileScore *) malloc(tileRows[i] * sizeof(TileScore));
     if (tileScores[i] == NULL) die("Could not init tileScores[i]");
+    resetScores(tileScores[i], tileRows[i]);
+  }
+  // testPrintScores(numTiles, tileScores, tileRows);  // ** DEBUG **
+  numGroups = numTiles;
+  if (opt_group >= 0) {
+    groupRep = (int *) malloc(numTiles * sizeof(int));
+    if (groupRep == NULL) die("Could not init groupRep");
+    reps = groupTiles(tileImg, tileScores, tileRows, numTiles, &hdr, opt_group, groupRep, &numGroups);
+    fprintf(stderr, "Grouped %d tile positions into %d groups\n", numTiles, numGroups);
   }
-  initArrays(numTiles, numBlocks, tileImg, tileScores);
-  // testPrintScores(numTiles, tileScores);  // ** DEBUG **
-  readTilesFromCSV(stdin, numTiles, numBlocks, tileImg);
 
   //--- Read and process every tile in library database file ---
-  fprintf(stderr, "Reading tile database file: %s \n", argv[1] );
+  libDB = openLibrary(opt_dbfile, &numLibTiles);
+  if (opt_filter) {
+    selList = selectRecords(libDB, numLibTiles, opt_dbfile, opt_indexfile, opt_filter, &selNum);
+  }
+  if (opt_exclude_num > 0) {
+    selList = excludeRecords(libDB, numLibTiles, selList, &selNum);
+  }
+  if (opt_prune_flag) {
+    chunksFile = sidecarFilename(opt_dbfile, "chunks");
+    if (chunksFile == NULL) die("Could not allocate filename");
+    chunks = openChunks(chunksFile, opt_dbfile, libDB, numLibTiles, numTiles, numBlocks);
+    free(chunksFile);
+  }
 
-  // get file size of tile database
-  struct stat statBuf;
-  stat(argv[1], &statBuf);
-  dbSize = statBuf.st_size;
-  numLibTiles = dbSize / sizeof(TileRecord);
-  fprintf(stderr, "  size:%d  numTiles:%d\n", dbSize, numLibTiles);
-  if (dbSize < sizeof(TileRecord)) die("Tile database doesn't exist or zero size!");
-
-  // open tile database
-  if ((DB = fopen(argv[1], "rb")) == NULL) die("Cannot open tile database file!");
-  
   //fprintf(stderr, "Reading Tile Library...\n");
   fprintf(stderr, "Computing Mosaic...\n");
   fprintf(stderr, "  tiles:%d  blocks:%d  lum:%d  vflip:%d  Wy:%d  Wc:%d  We:%d  dups:%d \n", 
-          numTiles, numBlocks, lumFlag, vflipFlag, Wy, Wc, We, dups);
+          numTiles, numBlocks, lumFlag, vflipFlag, hdr.Wy, hdr.Wc, hdr.We, hdr.dups);
+  if (opt_threads > 1) {
+    numNodes = initNodes(nodes, libDB, numLibTiles, selList, selNum, tileImg, tileScores, numTiles);
+  }
  
   timeBegin = time(NULL);
   clockBegin = clock();
   //fprintf(stderr, " start: %s", ctime(&timeBegin));
 
-  // read entire tile database into memory (not any faster, so not used)
-  /*
-  TileRecord *libDB;
-  libDB = (TileRecord*) malloc(sizeof(TileRecord) * numLibTiles);
-  if (libDB == NULL) die("Could not allocate memory for tile database.");
-  if ( fread(libDB, sizeof(TileRecord), numLibTiles, DB) != numLibTiles ) die("Problem reading entire tile database!");
-  */
-
   //--- loop through every image in tile database ---
-  //fprintf(stderr, "Computing Mosaic...\n");
-  for (i=0; i < numLibTiles; i++) {
-
-    // output current tile record number followed by CR to keep cursor on same line
-    // skip every 10
-    if ((i % 10) == 0) {
-      fprintf(stderr, "%d  (%.1f%%)\r", i, (100.0f * (i+1)/numLibTiles) );
-    }
-
-    // read a tile one at a time
-    if ( fread(&libImg, sizeof(TileRecord), 1, DB) != 1 ) die("Problem reading tile record!");
-
-    // process one tile at a time
-    if (libImg.magic != TILE_MAGIC) die("Tile magic number invalid.");
-    processLibImg(&libImg, tileImg, tileScores, numTiles, numBlocks, lumFlag, Wy, Wc, We, dups);
-
-    if (vflipFlag) {   // ** DONE, NOT TESTED **
-      // flip the lib tile vertically, then process again
-      flipTileVertically(&libImg, Xblocks, Yblocks);
-      processLibImg(&libImg, tileImg, tileScores, numTiles, numBlocks, lumFlag, Wy, Wc, We, dups);
-    }
-
-    // if processing entire DB in memory (not any faster)
-    //if (libDB[i].magic != TILE_MAGIC) die("Tile magic number invalid.");
-    //processLibImg(&libDB[i], tileImg, tileScores, numTiles, numBlocks, lumFlag, Wy, Wc, We, dups);
+  if (opt_mem_budget) {
+    SPILL = scanInPasses(nodes, numNodes, libDB, numLibTiles, selList, selNum, tileImg, tileScores, tileRows,
+                         numTiles, &hdr, chunks, &spill, &pruned);
+  }
+  else {
+    pruned = scanTiles(nodes, numNodes, libDB, numLibTiles, selList, selNum, tileImg, tileScores, tileRows,
+                       reps, numGroups, &hdr, chunks);
   }
+
   clockEnd = clock();
   timeEnd = time(NULL);
   clockDiff = ((double) (clockEnd - clockBegin)) / CLOCKS_PER_SEC;
   fprintf(stderr, "\n");
   //fprintf(stderr, "   end: %s", ctime(&timeEnd));
   fprintf(stderr, "Mosaic took %.2f secs. (%.0f secs)\n", clockDiff, difftime(timeEnd, timeBegin) );
+  if (chunks) {
+    fprintf(stderr, "  skipped %d of %d chunks%s\n", pruned, chunks->header->numChunks,
+            (opt_threads > 1) ? " (counted by every thread)" : ((SPILL) ? " (counted by every pass)" : ""));
+  }
 
-  // free if entire DB in memory (not used)
-  //free(libDB);
-  //libDB = NULL;
-
-  // close tile database
-  if (fclose(DB) != 0) die("Cannot close tile database file!");
-
-  //testPrintScores(numTiles, tileScores);  // ** DEBUG **
+  //testPrintScores(numTiles, tileScores, tileRows);  // ** DEBUG **
+  if (opt_cachefile && SPILL == NULL) {
+    saveCache(opt_cachefile, &hdr, numTiles, tileScores, tileRows, tileImg, opt_dbfile, libDB, numLibTiles);
+  }
 
   //--- output Mosaic CSV ---
   fprintf(stderr, "Outputing Mosaic CSV...\n");
-  printf("%d,%d,%d,%d,%d,%d,%d,%d,%d\n", Xtiles, Ytiles, Xblocks, Yblocks, flags, Wy, Wc, We, dups);
-  writeTiles(stdout, numTiles, dups, tileScores, tileImg);
+  OUTFILE = openFrameOutput(frame);
+  writeHeader(OUTFILE, &hdr);
+  if (SPILL) {
+    writeCacheTiles(SPILL, &spill, OUTFILE);
+    if (fclose(SPILL) != 0) die("Cannot close cache file!");
+  }
+  else {
+    writeTiles(OUTFILE, numTiles, hdr.dups, tileScores, tileRows, tileImg);
+  }
+  closeFrameOutput(OUTFILE);
+
+  //--- Sequence mode: process remaining master frames ---
+  if (opt_seq_flag) {
+    frameImg = (TileRecord *) calloc(numTiles, sizeof(TileRecord));
+    if (frameImg == NULL) die("Could not init frameImg");
+    changed = (int *) malloc(numTiles * sizeof(int));
+    if (changed == NULL) die("Could not init changed list");
+    scoredYdelta = (int16_t *) malloc(numTiles * sizeof(int16_t));  // tileImg Ydelta is per frame
+    if (scoredYdelta == NULL) die("Could not init scoredYdelta");
+    for (i=0; i < numTiles; i++) { scoredYdelta[i] = tileImg[i].Ydelta; }
+
+    while (readHeaderCSV(stdin, &frameHdr)) {
+      frame++;
+      if (memcmp(&frameHdr, &hdr, sizeof(MosaicHeader)) != 0) {
+        die("Every frame in sequence must have the same CSV first line!");
+      }
+      if (readTilesFromCSV(stdin, numTiles, numBlocks, frameImg) != numTiles) {
+        die("In sequence mode, every frame must list every tile position!");
+      }
+
+      // compare against tiles as they were last scored, so small changes don't add up unnoticed
+      // (score 0 may still differ, so 0 compares exactly)
+      numChanged = 0;
+      for (i=0; i < numTiles; i++) {
+        tileImg[i].Ydelta = scoredYdelta[i];
+        if ((opt_seq_score == 0) ? !sameTile(&frameImg[i], &tileImg[i], numBlocks, lumFlag)
+            : tileScore(&frameImg[i], &tileImg[i], numBlocks, lumFlag, hdr.Wy, hdr.Wc, hdr.We) > opt_seq_score) {
+          tileImg[i] = frameImg[i];
+          scoredYdelta[i] = frameImg[i].Ydelta;
+          resetScores(tileScores[i], tileRows[i]);
+          changed[numChanged++] = i;
+        }
+        tileImg[i].Ydelta = frameImg[i].Ydelta;  // output for this frame
+      }
+      fprintf(stderr, "Frame %d: re-scoring %d of %d tiles\n", frame, numChanged, numTiles);
+
+      if (numChanged > 0) {
+        clockBegin = clock();
+        scanTiles(nodes, numNodes, libDB, numLibTiles, selList, selNum, tileImg, tileScores, tileRows,
+                  changed, numChanged, &hdr, chunks);
+        clockDiff = ((double) (clock() - clockBegin)) / CLOCKS_PER_SEC;
+        fprintf(stderr, "\nFrame %d took %.2f secs.\n", frame, clockDiff);
+      }
+
+      OUTFILE = openFrameOutput(frame);
+      writeHeader(OUTFILE, &hdr);
+      writeTiles(OUTFILE, numTiles, hdr.dups, tileScores, tileRows, tileImg);
+      closeFrameOutput(OUTFILE);
+    }
+    fprintf(stderr, "Sequence done: %d frames\n", frame);
+
+    free(frameImg); frameImg = NULL;
+    free(changed); changed = NULL;
+    free(scoredYdelta); scoredYdelta = NULL;
+  }
+
+  // unmap tile database
+  if (opt_threads > 1) freeNodes(nodes, numNodes, numTiles);
+  if (chunks) closeChunks(chunks);
+  closeLibrary(libDB, numLibTiles);
+  free(selList); selList = NULL;
 
   // free memory
   free(tileImg); tileImg = NULL;
   for (i=0; i < numTiles; i++) {
-    free(tileScores[i]); tileScores[i] = NULL;
+    if (groupRep == NULL || groupRep[i] == i) free(tileScores[i]);  // grouped rows are shared
+    tileScores[i] = NULL;
   }
   free(tileScores); tileScores = NULL;
+  free(tileRows); tileRows = NULL;
+  free(groupRep); groupRep = NULL;
+  free(reps); reps = NULL;
+  free(opt_locked); opt_locked = NULL;
 
 
   fprintf(stderr, "Done mosaic\n\n");
@@ -13,6 +13,26 @@
 // Constants
 #define BLOCKS  8*8               // number of blocks in a tile
 #define TILE_MAGIC  0x454C4954    // ASCII 'TILE' in reverse byte order
+#define ATLAS_MAGIC 0x534C5441    // ASCII 'ATLS' in reverse byte order
+#define INDEX_MAGIC 0x58444954    // ASCII 'TIDX' in reverse byte order
+#define CACHE_MAGIC 0x48434143    // ASCII 'CACH' in reverse byte order
+#define CHUNK_MAGIC 0x4B4E4843    // ASCII 'CHNK' in reverse byte order
+
+// Columns of tile attribute index, in order stored in index file
+#define INDEX_ASPECT  0           // xres * 1000 / yres, rounded (see aspectValue)
+#define INDEX_YDELTA  1           // Ydelta (brightness)
+#define INDEX_U       2           // mean U of blocks
+#define INDEX_V       3           // mean V of blocks
+#define INDEX_ID      4           // imageID
+#define INDEX_COLUMNS 5
+#define INDEX_SAMPLES 8           // imageIDs of records spread through index (or chunks), to check it
+
+// Sums of blocks in a tile, as stored in chunk summary (see sortdb.c)
+#define SUM_Y   0                 // sum of normalized Y
+#define SUM_YA  1                 // sum of Y + Ydelta (as scored without LumFlag)
+#define SUM_U   2                 // sum of U
+#define SUM_V   3                 // sum of V
+#define SUMS    4
 
 #pragma pack(push)  // push current alignment to stack
 #pragma pack(1)     // set alignment to 1 byte boundary
@@ -34,6 +54,46 @@ typedef struct {
   TilePixel pixel[BLOCKS];   // + 256 bytes
 } TileRecord;                // = 270 bytes total (was 268)
 
+typedef struct {
+  int32_t magic;             //     4 bytes  'ATLS'   (ATLAS_MAGIC)
+  int32_t imageID;           //     4 bytes  int32_t
+  int16_t width;             //     2 bytes  int16_t  tile width in pixels
+  int16_t height;            //     2 bytes  int16_t  tile height in pixels
+  int64_t offset;            // +   8 bytes  int64_t  offset of RGB pixels in atlas data file
+} AtlasEntry;                // = 20 bytes total
+
+typedef struct {
+  int32_t magic;             //     4 bytes  'TIDX'   (INDEX_MAGIC)
+  int32_t numRecords;        //     4 bytes  int32_t  records in tile database when indexed
+  int32_t firstID;           //     4 bytes  int32_t  imageID of first record
+  int32_t lastID;            //     4 bytes  int32_t  imageID of last indexed record
+  int64_t dbSize;            //     8 bytes  int64_t  tile database file size when indexed
+  int64_t dbTime;            //     8 bytes  int64_t  tile database modified time when indexed
+  int32_t sampleID[INDEX_SAMPLES];  // + 32 bytes   imageIDs of records at indexSample()
+} IndexHeader;               // = 64 bytes, followed by INDEX_COLUMNS * numRecords IndexEntry
+
+typedef struct {
+  int32_t value;             //     4 bytes  int32_t  attribute value
+  int32_t record;            // +   4 bytes  int32_t  record number in tile database
+} IndexEntry;                // = 8 bytes, each column is sorted by value, then record
+
+typedef struct {
+  int32_t magic;             //     4 bytes  'CHNK'   (CHUNK_MAGIC)
+  int32_t chunkSize;         //     4 bytes  int32_t  records per chunk
+  int32_t numChunks;         //     4 bytes  int32_t
+  int32_t numRecords;        //     4 bytes  int32_t  records in tile database when summarized
+  int32_t firstID;           //     4 bytes  int32_t  imageID of first record
+  int32_t lastID;            //     4 bytes  int32_t  imageID of last summarized record
+  int64_t dbSize;            //     8 bytes  int64_t  tile database file size when summarized
+  int64_t dbTime;            //     8 bytes  int64_t  tile database modified time when summarized
+  int32_t sampleID[INDEX_SAMPLES];  // + 32 bytes   imageIDs of records at indexSample()
+} ChunkHeader;               // = 72 bytes, followed by numChunks ChunkBounds
+
+typedef struct {
+  int32_t min[SUMS];         //    16 bytes  lowest sums of any tile in chunk
+  int32_t max[SUMS];         // +  16 bytes  highest sums of any tile in chunk
+} ChunkBounds;               // = 32 bytes
+
 #pragma pack(pop)   // restore original alignment from stack
 
 typedef struct {
@@ -41,4 +101,89 @@ typedef struct {
   int32_t id;   // signed, negative value means tile flipped vertically
 } TileScore;
 
+typedef struct {
+  int32_t Xtiles;   // first line of mosaic CSV input and output
+  int32_t Ytiles;
+  int32_t Xblocks;
+  int32_t Yblocks;
+  int32_t flags;    // 0x01 = LumFlag, 0x02 = VFlipFlag
+  int32_t Wy;
+  int32_t Wc;
+  int32_t We;
+  int32_t dups;
+} MosaicHeader;
+
+typedef struct {
+  int32_t magic;        // 'CACH'  (CACHE_MAGIC)
+  int32_t numTiles;     // number of tile positions in cache
+  int32_t topK;         // minimum candidates kept per position
+  int32_t numLibTiles;  // tile database fingerprint...
+  int32_t firstID;      //   imageID of first record
+  int32_t lastID;       //   imageID of last record
+  int64_t dbSize;       //   file size
+  int64_t dbTime;       //   file modified time
+  MosaicHeader hdr;     // scoring parameters
+  int32_t reserved;
+} CacheHeader;          // = 80 bytes, followed by numTiles of CacheEntry
+
+typedef struct {
+  int32_t pos;          // tile position
+  int32_t Ydelta;
+  int32_t num;          // number of candidates
+} CacheEntry;           // = 12 bytes, followed by num TileScore, lowest score first
+
+// Returns name of sidecar file next to tile database, replacing .db extension,
+// or NULL if out of memory. (e.g. "lib/mosaic.db" -> "lib/mosaic.idx")
+static inline char *sidecarFilename(const char *dbFile, const char *ext)
+{
+  size_t n = strlen(dbFile);
+  char *name = (char *) malloc(n + strlen(ext) + 2);
+  if (name == NULL) return NULL;
+  strcpy(name, dbFile);
+  if (n > 3 && strcmp(name + n - 3, ".db") == 0) { name[n - 3] = '\0'; }
+  strcat(name, ".");
+  strcat(name, ext);
+  return name;
+}
+
+// Returns record number of sample s of an index or chunk summary of numRecords (see sampleID).
+static inline int indexSample(int numRecords, int s)
+{
+  return (int)((int64_t)(numRecords - 1) * (s + 1) / (INDEX_SAMPLES + 1));
+}
+
+// Converts an aspect ratio (xres/yres) to the value stored in the index.
+static inline int32_t aspectValue(double aspect)
+{
+  return (int32_t)(aspect * 1000 + 0.5);
+}
+
+// Computes the indexed attributes of a tile record.
+static inline void tileAttributes(const TileRecord *tile, int32_t *attrs)
+{
+  int j, sumU = 0, sumV = 0;
+  for (j=0; j < BLOCKS; j++) {
+    sumU += tile->pixel[j].U;
+    sumV += tile->pixel[j].V;
+  }
+  attrs[INDEX_ASPECT] = (tile->yres > 0) ? aspectValue((double)tile->xres / tile->yres) : 0;
+  attrs[INDEX_YDELTA] = tile->Ydelta;
+  attrs[INDEX_U]      = sumU / (BLOCKS);
+  attrs[INDEX_V]      = sumV / (BLOCKS);
+  attrs[INDEX_ID]     = tile->imageID;
+}
+
+// Computes the sums of blocks of a tile record (see SUM_Y, etc.)
+static inline void tileSums(const TileRecord *tile, int numBlocks, int32_t *sums)
+{
+  int j;
+  sums[SUM_Y] = sums[SUM_U] = sums[SUM_V] = 0;
+  for (j=0; j < numBlocks; j++) {
+    sums[SUM_Y] += tile->pixel[j].Y;
+    sums[SUM_U] += tile->pixel[j].U;
+    sums[SUM_V] += tile->pixel[j].V;
+  }
+  sums[SUM_YA] = sums[SUM_Y] + numBlocks * tile->Ydelta;
+}
+
 #endif
@@ -0,0 +1,325 @@
+#!/usr/bin/perl -w
+#------------------------------------------------------------------------------
+# pyramid.pl
+#
+# Takes CSV output from mosaic.c and creates a Deep Zoom (DZI) tile pyramid,
+# for viewing gigapixel photomosaics with a viewer such as OpenSeadragon.
+# The full size mosaic image is never created. Each output tile is made
+# directly from the tile images it covers, using the _lg, _md or _sm size
+# closest to the level's scale, several output tiles per ImageMagick run.
+# Levels smaller than the _sm tiles are made by downsampling the level above.
+#
+# Runs are resumable: a manifest records what every output tile was made
+# from, including the size and modified time of each tile image, so running
+# again (e.g. after changing some tiles in the mosaic CSV, or making some tile
+# images again) only makes the output tiles that changed or are missing.
+#
+# Version History:
+#  (v1.0) 10/18/2026
+#
+#------------------------------------------------------------------------------
+
+use strict;
+use warnings;
+use POSIX qw(ceil floor);
+use Digest::MD5 qw(md5_hex);
+use File::Path qw(make_path);
+
+#------------------------------------------------------------------------------
+# Print Usage info
+
+sub usage()
+{
+  print STDERR "Creates Deep Zoom tile pyramid from mosaic program's CSV output. (v1.0) \n\n";
+  print STDERR "Usage: pyramid.pl lib_path output [jobs] < input.csv \n";
+  print STDERR "       lib_path is the root library path where tile images are located.\n";
+  print STDERR "       output is name of pyramid to create, as output.dzi and output_files/\n";
+  print STDERR "       jobs is number of ImageMagick processes to run at once. (default = 4)\n";
+  print STDERR "       input.csv is the CSV file from mosaic's output.\n\n";
+  exit(1);
+}
+
+# Define Constants
+my $tileSize = 256;       # size of output tiles
+my $format = 'jpg';       # format of output tiles
+my $quality = 90;         # jpg quality
+my %tileSizeExt = ( 'sm' => '_sm.jpg', 'med' => '_md.jpg', 'lg' => '_lg.jpg' );
+my %tileScale = ( 'sm' => 0.0625, 'med' => 0.25, 'lg' => 1 );  # sizes made by addtiles.pl
+
+#------------------------------------------------------------------------------
+# Returns path + name of tile image from imgID (e.g. "lib/00/00/00/00000001_sm.jpg")
+
+sub tileFile
+{
+  my ($libPath, $imgID, $sizeType) = @_;
+  my $imgIDstr = sprintf('%08d', $imgID);
+  return $libPath . substr($imgIDstr, 0, 2) .'/'. substr($imgIDstr, 2, 2) .'/'.
+         substr($imgIDstr, 4, 2) .'/'. $imgIDstr . $tileSizeExt{$sizeType};
+}
+
+#------------------------------------------------------------------------------
+# Runs a list of jobs using forked worker processes.
+# Each job is [ \@done, @convertArgs ], where @done is the "key signature" of
+# each output tile it makes. When a job is done, these are appended to the
+# worker's part of the manifest.
+
+sub runJobs
+{
+  my ($jobs, $numWorkers, $manifestPart) = @_;
+  my @pids = ();
+
+  for (my $w=0; $w < $numWorkers; $w++) {
+    my $pid = fork();
+    die "ERROR: Can't fork: $!" unless defined $pid;
+    if ($pid == 0) {
+      # worker does every numWorkers'th job
+      open(PART, '>>', "$manifestPart.$w") or die "Error appending to $manifestPart.$w : $!";
+      for (my $i = $w; $i < scalar(@$jobs); $i += $numWorkers) {
+        my ($done, @args) = @{ $jobs->[$i] };
+        system('convert', @args) == 0
+          or die "ImageMagick error: $! (errcode $?) making ". join(', ', @$done);
+        print PART "$_\n" foreach (@$done);
+      }
+      close PART;
+      exit(0);
+    }
+    push @pids, $pid;
+  }
+
+  my $failed = 0;
+  foreach my $pid (@pids) {
+    waitpid($pid, 0);
+    $failed = 1 if ($? != 0);
+  }
+  die "ERROR: A worker process failed. Run again to resume." if $failed;
+}
+
+#------------------------------------------------------------------------------
+# Main Program
+{
+  #--- Retrieve command line ---
+  if (scalar @ARGV < 2 || scalar @ARGV > 3) { usage(); }
+  print STDERR "Running $0\n";  ## TEST ##
+
+  my $libPath = shift @ARGV;
+  if (substr($libPath, -1, 1) ne '/') { $libPath .= '/'; }
+  my $outName = shift @ARGV;
+  my $numWorkers = (scalar @ARGV) ? shift @ARGV : 4;
+  if ($numWorkers < 1) { usage(); }
+  my $outDir = $outName .'_files/';
+
+  #--- Read input.csv ---
+  my $line = <STDIN>;
+  chomp $line;
+  my ($xTiles, $yTiles, $xBlocks, $yBlocks, $lumFlag, $Wy, $Wc, $We, $dups, undef) = split(',', $line);
+  print STDERR "Creating pyramid of ${xTiles}x${yTiles} tiled photomosaic.\n";  ## TEST ##
+
+  # blank tiles are imgID 0, same as create.pl
+  my ($pos, $Ydelta, $imgID);
+  my @imgIDs = (0) x ($xTiles * $yTiles);
+  while ($line = <STDIN>) {
+    chomp $line;
+    ($pos, $Ydelta, $imgID, undef) = split(',', $line);
+    $imgIDs[$pos] = $imgID;
+  }
+
+  #--- Size of pyramid ---
+  # cell size is size of first _lg tile image found
+  my ($cellW, $cellH) = (0, 0);
+  foreach $imgID (@imgIDs) {
+    my $file = tileFile($libPath, abs($imgID), 'lg');
+    next unless (-e $file);
+    # list form, so the path never goes through the shell
+    open(my $fh, '-|', 'identify', '-format', '%w %h', $file) or die "ERROR: Can't fork to identify: $!";
+    ($cellW, $cellH) = split(' ', <$fh> // '');
+    close($fh) or die "ImageMagick error: $! (errcode $?)";
+    last;
+  }
+  if (!$cellW) { die "ERROR: None of the mosaic's tile images found in $libPath"; }
+
+  my $width = $xTiles * $cellW;
+  my $height = $yTiles * $cellH;
+  my $maxLevel = ceil(log(($width > $height) ? $width : $height) / log(2));
+  print STDERR "  size: ${width}x${height}  levels: ". ($maxLevel + 1) ."  tile size: $tileSize\n";
+
+  #--- Read manifest of tiles already made ---
+  my $manifest = $outDir .'manifest.txt';
+  my %done = ();
+  make_path($outDir);
+  foreach my $file ($manifest, glob("$manifest.part.*")) {
+    open(MAN, '<', $file) or next;
+    while ($line = <MAN>) {
+      chomp $line;
+      my ($key, $sig) = split(' ', $line);
+      $done{$key} = $sig;
+    }
+    close MAN;
+  }
+
+  #--- Create levels, largest first ---
+  # Levels where cells are at least as big as _sm tiles are made from tile images.
+  # Smaller levels are made by downsampling 2x2 tiles of the level above.
+  my %sigs = ();     # signatures of current tiles, "level/col_row" => md5
+  my %stamps = ();   # size and modified time of tile images, '' if missing
+  my @srcJobs = ();
+  my @levelJobs = ();
+  my ($made, $skipped) = (0, 0);
+
+  # Returns ImageMagick args compositing every mosaic tile that overlaps region
+  # (x0, y0, w, h) of a level, and the stamps of the tile images used, so that
+  # a tile image made again under the same name is noticed.
+  my $compositeArgs = sub {
+    my ($x0, $y0, $w, $h, $cw, $ch, $sizeType) = @_;
+    my (@args, @used);
+    for (my $ty = floor($y0 / $ch); $ty < $yTiles && $ty * $ch < $y0 + $h; $ty++) {
+      for (my $tx = floor($x0 / $cw); $tx < $xTiles && $tx * $cw < $x0 + $w; $tx++) {
+        my $id = $imgIDs[$ty * $xTiles + $tx];
+        my $file = tileFile($libPath, abs($id), $sizeType);
+        $stamps{$file} //= join('.', (stat($file))[7, 9]);
+        next if ($stamps{$file} eq '');
+        my ($cx0, $cy0) = (floor($tx * $cw), floor($ty * $ch));
+        my ($cx1, $cy1) = (floor(($tx + 1) * $cw), floor(($ty + 1) * $ch));
+        push @args, '(', $file, '-resize', ($cx1 - $cx0) .'x'. ($cy1 - $cy0) .'!';
+        push @args, '-flop' if ($id < 0);
+        push @args, ')', '-geometry', sprintf('%+d%+d', $cx0 - $x0, $cy0 - $y0), '-composite';
+        push @used, $stamps{$file};
+      }
+    }
+    return (\@args, \@used);
+  };
+
+  for (my $level = $maxLevel; $level >= 0; $level--) {
+    my $scale = 2 ** ($maxLevel - $level);
+    my $levelW = ceil($width / $scale);
+    my $levelH = ceil($height / $scale);
+    my $cols = ceil($levelW / $tileSize);
+    my $rows = ceil($levelH / $tileSize);
+    my $cw = $cellW / $scale;  # cell size at this level
+    my $ch = $cellH / $scale;
+    my $fromSource = ($cw >= $cellW * $tileScale{'sm'});
+    my @jobs = ();
+
+    # smallest tile image size that is still big enough
+    my $sizeType = ($cw <= $cellW * $tileScale{'sm'}) ? 'sm' : (($cw <= $cellW * $tileScale{'med'}) ? 'med' : 'lg');
+    make_path($outDir . $level);
+
+    # Tiles made from tile images are made in blocks of up to 8x8 tiles, one
+    # ImageMagick run each, so every tile image is read once per block instead
+    # of once per output tile. Blocks cover up to about 16x16 cells.
+    my $block = ($fromSource) ? floor(16 * $cw / $tileSize) : 1;
+    $block = 8 if ($block > 8);
+    $block = 1 if ($block < 1);
+
+    for (my $brow=0; $brow < $rows; $brow += $block) {
+      for (my $bcol=0; $bcol < $cols; $bcol += $block) {
+        my ($bx0, $by0) = ($bcol * $tileSize, $brow * $tileSize);
+        my @done = ();     # "key signature" of tiles made by block
+        my @crops = ();    # args cropping each of those tiles out of block
+
+        for (my $row = $brow; $row < $rows && $row < $brow + $block; $row++) {
+          for (my $col = $bcol; $col < $cols && $col < $bcol + $block; $col++) {
+            my $key = "$level/${col}_${row}";
+            my $outFile = $outDir . $key .'.'. $format;
+            my ($x0, $y0) = ($col * $tileSize, $row * $tileSize);
+            my $tw = (($x0 + $tileSize) < $levelW) ? $tileSize : ($levelW - $x0);
+            my $th = (($y0 + $tileSize) < $levelH) ? $tileSize : ($levelH - $y0);
+            my @args = ();
+            my $used = [];
+
+            if ($fromSource) {
+              # composite every mosaic tile overlapping this output tile
+              my $tileArgs;
+              ($tileArgs, $used) = $compositeArgs->($x0, $y0, $tw, $th, $cw, $ch, $sizeType);
+              @args = ('-size', "${tw}x${th}", 'xc:black', @$tileArgs);
+            }
+            else {
+              # downsample 2x2 tiles from level above
+              my $up = $outDir . ($level + 1) .'/';
+              my $upCols = ceil(ceil($width / ($scale / 2)) / $tileSize);
+              my $upRows = ceil(ceil($height / ($scale / 2)) / $tileSize);
+              for (my $dy=0; $dy < 2; $dy++) {
+                next if (2 * $row + $dy >= $upRows);
+                push @args, '(';
+                for (my $dx=0; $dx < 2; $dx++) {
+                  next if (2 * $col + $dx >= $upCols);
+                  push @args, $up . (2 * $col + $dx) .'_'. (2 * $row + $dy) .'.'. $format;
+                }
+                push @args, '+append', ')';
+              }
+              push @args, '-append', '-resize', "${tw}x${th}!";
+            }
+            push @args, '-quality', $quality if ($format eq 'jpg');
+
+            # signature of everything this tile is made from
+            my $sig = md5_hex(join(' ', "${tw}x${th}", @args, @$used));
+            if (!$fromSource) {
+              my $child = '';
+              for (my $dy=0; $dy < 2; $dy++) {
+                for (my $dx=0; $dx < 2; $dx++) {
+                  $child .= $sigs{($level + 1) .'/'. (2 * $col + $dx) .'_'. (2 * $row + $dy)} // '';
+                }
+              }
+              $sig = md5_hex($sig . $child);
+            }
+            $sigs{$key} = $sig;
+
+            if (defined($done{$key}) && $done{$key} eq $sig && (-e $outFile)) { $skipped++; next; }
+            $made++;
+            if ($fromSource) {
+              push @done, "$key $sig";
+              push @crops, '(', '+clone', '-crop', "${tw}x${th}+". ($x0 - $bx0) .'+'. ($y0 - $by0), '+repage',
+                           '-write', $outFile, '+delete', ')';
+            }
+            else {
+              push @jobs, [ [ "$key $sig" ], @args, $outFile ];
+            }
+          }
+        }
+
+        if (scalar @crops) {
+          # make whole block, then write each tile needed
+          my $bw = (($bx0 + $block * $tileSize) < $levelW) ? $block * $tileSize : ($levelW - $bx0);
+          my $bh = (($by0 + $block * $tileSize) < $levelH) ? $block * $tileSize : ($levelH - $by0);
+          my ($blockArgs) = $compositeArgs->($bx0, $by0, $bw, $bh, $cw, $ch, $sizeType);
+          my @args = ('-size', "${bw}x${bh}", 'xc:black', @$blockArgs);
+          push @args, '-quality', $quality if ($format eq 'jpg');
+          push @jobs, [ \@done, @args, @crops, 'null:' ];
+        }
+      }
+    }
+
+    # levels from tile images don't depend on each other, so run them all together
+    if ($fromSource) { push @srcJobs, @jobs; }
+    else { push @levelJobs, \@jobs; }
+  }
+  print STDERR "  tiles to make: $made  unchanged: $skipped\n";
+
+  #--- Make tiles ---
+  my $timeBegin = time;
+  runJobs(\@srcJobs, $numWorkers, "$manifest.part");
+  foreach my $jobs (@levelJobs) {
+    runJobs($jobs, $numWorkers, "$manifest.part");
+  }
+  my $timeEnd = time;
+  print STDERR sprintf( "Pyramid took %.0f secs.\n", $timeEnd - $timeBegin );
+
+  #--- Write manifest and DZI descriptor ---
+  open(MAN, '>', "$manifest.new") or die "Error writing $manifest.new : $!";
+  foreach my $key (sort keys %sigs) {
+    print MAN "$key $sigs{$key}\n";
+  }
+  close MAN or die "Can't close $manifest.new: $!\n";
+  rename("$manifest.new", $manifest) or die "Can't rename $manifest.new: $!\n";
+  unlink glob("$manifest.part.*");
+
+  open(DZI, '>', $outName .'.dzi') or die "Error writing $outName.dzi : $!";
+  print DZI "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  print DZI "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"$format\" Overlap=\"0\" TileSize=\"$tileSize\">\n";
+  print DZI "  <Size Width=\"$width\" Height=\"$height\"/>\n";
+  print DZI "</Image>\n";
+  close DZI or die "Can't close $outName.dzi: $!\n";
+
+  print STDERR "Done $0\n\n";  ## TEST ##
+}
+
+# EOF
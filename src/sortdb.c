@@ -0,0 +1,247 @@
+/*-----------------------------------------------------------------------------
+  sortdb.c
+  10/18/2026
+
+  Writes a copy of a tile database sorted so that tiles of similar color are
+  next to each other, along a 3D Hilbert curve over the mean Y, U and V of
+  each tile. Also writes a chunk summary next to it (e.g. mosaic.chunks),
+  holding the lowest and highest block sums of every chunk of records, which
+  mosaic's -p option uses to skip whole chunks that can't beat any tile
+  position's current candidates.
+
+  Records keep their imageID, so tile images, atlas files and mosaic.txt
+  stay the same. Only the order of records in the database changes.
+
+  Chunk summary file format:
+    ChunkHeader
+    numChunks of ChunkBounds
+
+  ChunkHeader holds the sorted database's size, modified time and a sample
+  of its imageIDs, so mosaic refuses a summary that doesn't match it.
+
+  -----------------------------------------------------------------------------
+*/
+
+// Libraries
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "mosaic.h"
+
+//-----------------------------------------------------------------------------
+// Command Line Options
+
+#define HILBERT_BITS  8   // bits per axis
+
+// option vars
+const char *opt_dbfile = NULL;
+const char *opt_outfile = NULL;
+int opt_chunk_size = 64;
+
+int usage(const char *progname) {
+
+  fprintf(stderr, "sortdb - sorts a tile database by color and summarizes chunks\n");
+  fprintf(stderr, "Usage: %s [options] tile_bin.db sorted_bin.db\n", progname);
+  fprintf(stderr, "Options:\n"
+    "\t-n <num> : Number of records per chunk in chunk summary. (default=64)\n"
+    "\n"
+  );
+  return 1;
+}
+
+int cmdLine(int argc, char *argv[]) {
+
+  // command line options
+  int opt;
+  while ((opt = getopt(argc, argv, "?n:")) != -1) {
+    switch (opt) {
+      case 'n':  // chunk size
+        if (sscanf(optarg, "%d", &opt_chunk_size) != 1 || opt_chunk_size < 1) {
+          fprintf(stderr, "Invalid chunk size '%s'\n", optarg);
+          return usage(argv[0]);
+        }
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 2) return usage(argv[0]);
+  opt_dbfile = argv[optind];
+  opt_outfile = argv[optind + 1];
+  return 0;
+}
+
+void die(char* errMsg) {
+
+  fprintf(stderr, "\nERROR: %s\n", errMsg);
+  exit(1);
+}
+
+//-----------------------------------------------------------------------------
+// Returns distance along 3D Hilbert curve of point x[3], where each axis has
+// HILBERT_BITS bits. (John Skilling's transpose method, "Programming the
+// Hilbert curve", 2004)
+
+uint32_t hilbertKey(uint32_t x[3])
+{
+  uint32_t M = 1 << (HILBERT_BITS - 1), P, Q, t, key = 0;
+  int i, b;
+
+  // inverse undo
+  for (Q = M; Q > 1; Q >>= 1) {
+    P = Q - 1;
+    for (i=0; i < 3; i++) {
+      if (x[i] & Q) { x[0] ^= P; }
+      else { t = (x[0] ^ x[i]) & P;  x[0] ^= t;  x[i] ^= t; }
+    }
+  }
+
+  // gray encode
+  for (i=1; i < 3; i++) { x[i] ^= x[i-1]; }
+  t = 0;
+  for (Q = M; Q > 1; Q >>= 1) {
+    if (x[2] & Q) t ^= Q - 1;
+  }
+  for (i=0; i < 3; i++) { x[i] ^= t; }
+
+  // interleave bits of transposed axes
+  for (b = HILBERT_BITS - 1; b >= 0; b--) {
+    for (i=0; i < 3; i++) { key = (key << 1) | ((x[i] >> b) & 1); }
+  }
+  return key;
+}
+
+typedef struct {
+  uint32_t key;
+  int32_t record;
+} SortKey;
+
+int compareKeys(const void *a, const void *b)
+{
+  const SortKey *ka = (const SortKey *) a;
+  const SortKey *kb = (const SortKey *) b;
+  if (ka->key != kb->key) return (ka->key < kb->key) ? -1 : 1;
+  return (ka->record < kb->record) ? -1 : (ka->record > kb->record);  // keep database order
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char *argv[]) {
+
+  // init variables
+  int e, i, c, s, fd, numLibTiles;
+  int32_t sums[SUMS];
+  uint32_t x[3];
+  char *chunksFile;
+  FILE *OUTFILE;
+  time_t timeBegin, timeEnd;
+  struct stat statBuf, outStat;
+  TileRecord *libDB;
+  SortKey *keys;
+  ChunkHeader header;
+  ChunkBounds *bounds;
+
+  // process command line
+  if ( (e = cmdLine(argc, argv)) ) { return e; }
+  chunksFile = sidecarFilename(opt_outfile, "chunks");
+  if (chunksFile == NULL) die("Could not allocate filename");
+  fprintf(stderr, "Running sortdb...\n");
+
+  // map tile database
+  fprintf(stderr, "Input tile database: %s \n", opt_dbfile);
+  if ((fd = open(opt_dbfile, O_RDONLY)) < 0) die("Cannot open tile database file!");
+  if (fstat(fd, &statBuf) != 0) die("Cannot stat tile database file!");
+  numLibTiles = statBuf.st_size / sizeof(TileRecord);
+  fprintf(stderr, "  size:%lld  numTiles:%d\n", (long long)statBuf.st_size, numLibTiles);
+  if (numLibTiles < 1) die("Input tile database doesn't exist or is zero size!");
+  if (stat(opt_outfile, &outStat) == 0 && outStat.st_dev == statBuf.st_dev && outStat.st_ino == statBuf.st_ino) {
+    die("Output tile database must be a different file than input!");
+  }
+  libDB = (TileRecord *) mmap(NULL, statBuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (libDB == MAP_FAILED) die("Cannot map tile database file!");
+  close(fd);
+
+  timeBegin = time(NULL);
+
+  // find position of every tile along curve, using mean Y, U, V
+  fprintf(stderr, "Sorting Tiles...\n");
+  keys = (SortKey *) malloc(numLibTiles * sizeof(SortKey));
+  if (keys == NULL) die("Could not allocate sort keys");
+  for (i=0; i < numLibTiles; i++) {
+    if (libDB[i].magic != TILE_MAGIC) die("Tile magic number invalid.");
+    tileSums(&libDB[i], BLOCKS, sums);
+    x[0] = (sums[SUM_YA] < 0) ? 0 : ((sums[SUM_YA] / (BLOCKS) > 255) ? 255 : sums[SUM_YA] / (BLOCKS));
+    x[1] = sums[SUM_U] / (BLOCKS);
+    x[2] = sums[SUM_V] / (BLOCKS);
+    keys[i].key = hilbertKey(x);
+    keys[i].record = i;
+  }
+  qsort(keys, numLibTiles, sizeof(SortKey), compareKeys);
+
+  // write sorted database and summarize each chunk
+  fprintf(stderr, "Output tile database: %s \n", opt_outfile);
+  header.magic = CHUNK_MAGIC;
+  header.chunkSize = opt_chunk_size;
+  header.numChunks = (numLibTiles + opt_chunk_size - 1) / opt_chunk_size;
+  header.numRecords = numLibTiles;
+  header.firstID = libDB[keys[0].record].imageID;
+  header.lastID = libDB[keys[numLibTiles - 1].record].imageID;
+  bounds = (ChunkBounds *) malloc(header.numChunks * sizeof(ChunkBounds));
+  if (bounds == NULL) die("Could not allocate chunk bounds");
+  for (c=0; c < header.numChunks; c++) {
+    for (s=0; s < SUMS; s++) {
+      bounds[c].min[s] = INT32_MAX;
+      bounds[c].max[s] = INT32_MIN;
+    }
+  }
+
+  if ((OUTFILE = fopen(opt_outfile, "wb")) == NULL) die("Cannot open output tile database file!");
+  for (i=0; i < numLibTiles; i++) {
+    if (fwrite(&libDB[keys[i].record], sizeof(TileRecord), 1, OUTFILE) != 1) die("Problem writing tile database!");
+    tileSums(&libDB[keys[i].record], BLOCKS, sums);
+    c = i / opt_chunk_size;
+    for (s=0; s < SUMS; s++) {
+      if (sums[s] < bounds[c].min[s]) bounds[c].min[s] = sums[s];
+      if (sums[s] > bounds[c].max[s]) bounds[c].max[s] = sums[s];
+    }
+  }
+  if (fclose(OUTFILE) != 0) die("Cannot close output tile database file!");
+
+  // fingerprint of sorted database, checked by mosaic -p
+  if (stat(opt_outfile, &outStat) != 0) die("Cannot stat output tile database file!");
+  header.dbSize = outStat.st_size;
+  header.dbTime = outStat.st_mtime;
+  for (s=0; s < INDEX_SAMPLES; s++) {
+    header.sampleID[s] = libDB[keys[indexSample(numLibTiles, s)].record].imageID;
+  }
+
+  fprintf(stderr, "Output chunk summary: %s \n", chunksFile);
+  if ((OUTFILE = fopen(chunksFile, "wb")) == NULL) die("Cannot open chunk summary file!");
+  if (fwrite(&header, sizeof(ChunkHeader), 1, OUTFILE) != 1) die("Problem writing chunk summary!");
+  if (fwrite(bounds, sizeof(ChunkBounds), header.numChunks, OUTFILE) != header.numChunks) {
+    die("Problem writing chunk summary!");
+  }
+  if (fclose(OUTFILE) != 0) die("Cannot close chunk summary file!");
+
+  timeEnd = time(NULL);
+  fprintf(stderr, "Tiles sorted: %d  chunks: %d\n", numLibTiles, header.numChunks);
+  fprintf(stderr, "Took %.0f secs.\n", difftime(timeEnd, timeBegin) );
+  fprintf(stderr, "Run mkindex again if the sorted database replaces one with an index.\n");
+
+  // free memory
+  munmap(libDB, statBuf.st_size);
+  free(keys);
+  free(bounds);
+  free(chunksFile);
+
+  return 0;
+}